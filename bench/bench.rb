@@ -0,0 +1,224 @@
+# Benchmarks for the hot paths of the library: LZW compression, full GIF
+# encoding of the examples, drawing primitives and color table operations.
+# Run them with `rake bench`, optionally restricting them to some of the suites,
+# e.g. `rake bench[lzw,draw]`. Each case is repeated for at least BENCH_TIME
+# seconds (0.5 by default).
+#
+# The results are printed as JSON lines, so that they can be collected and
+# compared across releases. The first line describes the environment, and every
+# other one is a case, with the following fields:
+# * `suite`, `case`: What was measured.
+# * `unit`:     What each of the processed items is (frame, op, pixel...).
+# * `count`:    Total amount of items processed during the measurement.
+# * `seconds`:  Total time spent processing them.
+# * `per_s`:    Items processed per second.
+# * `mb_s`:     Throughput of the input data in MB/s, if it makes sense.
+# * `allocs`:   Ruby objects allocated per item.
+require 'json'
+require 'tmpdir'
+require 'gifenc'
+
+module Bench
+  ROOT     = File.expand_path('..', __dir__)
+  MIN_TIME = (ENV['BENCH_TIME'] || 0.5).to_f
+  SIZES    = [64, 256, 1024]
+  SUITES   = {}
+
+  # Gifs saved by the examples, which are captured rather than written.
+  @captured = []
+
+  class << self
+    attr_reader :captured
+  end
+
+  # Define a suite of benchmarks.
+  def self.suite(name, &block)
+    SUITES[name] = block
+  end
+
+  def self.now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  # Repeatedly run a block and report the measurements. Each run processes
+  # `count` items of `bytes` bytes in total. The optional `setup` is run before
+  # each run without being measured, and its result is passed to the block.
+  def self.measure(suite, name, unit: 'op', count: 1, bytes: 0, setup: nil)
+    yield(setup&.call)
+    runs = seconds = allocs = 0
+    while seconds < MIN_TIME
+      arg = setup&.call
+      objects = GC.stat(:total_allocated_objects)
+      start = now
+      yield(arg)
+      seconds += now - start
+      allocs += GC.stat(:total_allocated_objects) - objects
+      runs += 1
+    end
+    total = runs * count
+    puts JSON.generate(
+      suite:   suite,
+      case:    name,
+      unit:    unit,
+      count:   total,
+      seconds: seconds.round(6),
+      per_s:   (total / seconds).round(2),
+      mb_s:    bytes > 0 ? (runs * bytes / seconds / 1e6).round(2) : nil,
+      allocs:  (allocs.to_f / total).round(2)
+    )
+    $stdout.flush
+  end
+
+  # Pixels of every frame of a GIF from res/, with their LZW code size.
+  def self.frames(path)
+    gif = Gifenc::Gif.load(path)
+    gif.images.map{ |img|
+      bits = img.lzw_bits(gif.gct)
+      img.decompress if img.compressed?
+      [img.pixels, bits]
+    }
+  end
+
+  # Run an example script in a temporary folder, capturing its GIF.
+  def self.example(path)
+    @captured.clear
+    Dir.mktmpdir{ |dir| Dir.chdir(dir){ load(path, true) } }
+    @captured.last
+  end
+end
+
+# Capture the GIFs of the examples instead of saving them.
+module Bench::Capture
+  def save(*args, **kwargs)
+    Bench.captured << self
+  end
+end
+Gifenc::Gif.prepend(Bench::Capture)
+
+Bench.suite('lzw') do
+  rng = Random.new(0)
+  size = 1024 * 1024
+  synthetic = {
+    'noise 8-bit' => [rng.bytes(size), 8],
+    'noise 2-bit' => [rng.bytes(size).bytes.map{ |b| b & 3 }.pack('C*'), 2],
+    'gradient'    => [Array.new(size){ |i| (i % 1024) / 4 }.pack('C*'), 8],
+    'solid'       => ["\x00".b * size, 8]
+  }
+  synthetic.each{ |name, (pixels, bits)|
+    [:standard, :deferred, :fast].each{ |strategy|
+      encoder = Gifenc::LZWEncoder.new
+      Bench.measure('lzw', "encode #{name} #{strategy}", unit: 'frame', bytes: pixels.bytesize){
+        encoder.encode(pixels, bits: bits, strategy: strategy)
+      }
+    }
+  }
+
+  Dir[File.join(Bench::ROOT, 'res', '*.gif')].sort.each{ |path|
+    name = File.basename(path)
+    frames = Bench.frames(path)
+    bytes = frames.sum{ |pixels, _| pixels.bytesize }
+    encoder = Gifenc::LZWEncoder.new
+    Bench.measure('lzw', "encode #{name}", unit: 'frame', count: frames.size, bytes: bytes){
+      frames.each{ |pixels, bits| encoder.encode(pixels, bits: bits) }
+    }
+    data = File.binread(path)
+    Bench.measure('lzw', "decode #{name}", unit: 'frame', count: frames.size, bytes: bytes){
+      Gifenc::Gif.read(data).images.each(&:decompress)
+    }
+  }
+end
+
+Bench.suite('encode') do
+  Dir[File.join(Bench::ROOT, 'examples', '*.rb')].sort.each{ |path|
+    name = File.basename(path, '.rb')
+    gif = Bench.example(path)
+    next if !gif
+    frames = gif.images.size
+    bytes = gif.images.sum{ |img| img.width * img.height }
+    Bench.measure('encode', "#{name} draw", unit: 'frame', count: frames){
+      Bench.example(path)
+    }
+
+    # Every image caches its compressed data, so each run encodes a new GIF
+    [1, 2].each{ |threads|
+      Bench.measure('encode', "#{name} write threads=#{threads}", unit: 'frame', count: frames, bytes: bytes, setup: -> { Bench.example(path) }){ |g|
+        g.write(threads: threads)
+      }
+    }
+  }
+end
+
+Bench.suite('draw') do
+  Bench::SIZES.each{ |dim|
+    pixels = dim * dim
+    rng = Random.new(dim)
+    img = Gifenc::Image.new(dim, dim)
+    src = Gifenc::Image.new(dim, dim, color: 1)
+    color = 0
+
+    Bench.measure('draw', "fill #{dim}x#{dim}", unit: 'op', bytes: pixels){
+      img.fill(0, 0, color = 1 - color)
+    }
+    Bench.measure('draw', "rect #{dim}x#{dim}", unit: 'op', bytes: pixels){
+      img.rect(0, 0, dim, dim, 2, color = 1 - color, weight: 2)
+    }
+    Bench.measure('draw', "copy #{dim}x#{dim}", unit: 'op', bytes: pixels){
+      img.copy(src: src)
+    }
+    Bench.measure('draw', "circle #{dim}x#{dim}", unit: 'op'){
+      img.circle([dim / 2, dim / 2], dim / 3, 2, color = 1 - color, weight: 2)
+    }
+    lines = Array.new(100){ [[rng.rand(dim), rng.rand(dim)], [rng.rand(dim), rng.rand(dim)]] }
+    Bench.measure('draw', "line #{dim}x#{dim}", unit: 'line', count: lines.size){
+      lines.each{ |p1, p2| img.line(p1: p1, p2: p2, color: 3, weight: 1) }
+    }
+  }
+end
+
+Bench.suite('palette') do
+  rng = Random.new(1)
+  colors = Array.new(256){ rng.rand(0x1000000) }
+  queries = Array.new(10_000){ rng.rand(0x1000000) }
+  rgb = rng.bytes(3 * 1024 * 1024)
+  canvas = Gifenc::Canvas.new(1024, 1024, data: rgb)
+  table = Gifenc::ColorTable.new(colors)
+  image = Gifenc::Image.new(1024, 1024).replace(table.map_rgb(rgb))
+  lut = Array.new(256){ |i| 255 - i }
+
+  Bench.measure('palette', 'nearest cold', unit: 'lookup', count: queries.size, setup: -> { Gifenc::ColorTable.new(colors) }){ |t|
+    queries.each{ |c| t.nearest(c) }
+  }
+  Bench.measure('palette', 'nearest warm', unit: 'lookup', count: queries.size){
+    queries.each{ |c| table.nearest(c) }
+  }
+  Bench.measure('palette', 'map_rgb 1MP', unit: 'frame', bytes: rgb.bytesize){
+    table.map_rgb(rgb)
+  }
+  Bench.measure('palette', 'quantize 1MP', unit: 'frame', bytes: rgb.bytesize){
+    canvas.quantize
+  }
+  [:bayer, :floyd_steinberg].each{ |dither|
+    Bench.measure('palette', "dither #{dither} 1MP", unit: 'frame', bytes: rgb.bytesize){
+      canvas.to_image(table: table, dither: dither)
+    }
+  }
+  Bench.measure('palette', 'remap 1MP', unit: 'frame', bytes: image.pixels.bytesize){
+    image.remap(lut)
+  }
+  Bench.measure('palette', 'uniq+compact', unit: 'op', setup: -> { Gifenc::ColorTable.new(colors.take(128) * 2) }){ |t|
+    t.uniq
+    t.compact
+  }
+end
+
+suites = ARGV.empty? ? Bench::SUITES.keys : ARGV
+unknown = suites - Bench::SUITES.keys
+abort "Unknown benchmark suites: #{unknown.join(', ')}" if !unknown.empty?
+
+puts JSON.generate(
+  gifenc:   Gem::Specification.load(File.join(Bench::ROOT, 'gifenc.gemspec')).version.to_s,
+  ruby:     RUBY_DESCRIPTION,
+  time:     Time.now.utc.strftime('%FT%TZ'),
+  min_time: Bench::MIN_TIME
+)
+suites.each{ |name| Bench::SUITES[name].call }
@@ -0,0 +1,534 @@
+#include "main.h"
+
+#include <fcntl.h>     // open
+#include <sys/stat.h>  // fstat
+#include <unistd.h>    // read, close
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>  // mmap, munmap
+#endif
+
+#define MAX_CODE_LEN 12
+#define MAX_DICT_LEN (1uL << MAX_CODE_LEN)
+
+/* Flat LZW decoding table: every code is its prefix code plus a suffix byte */
+typedef struct
+{
+  uint16_t prefix[MAX_DICT_LEN];
+  uint16_t length[MAX_DICT_LEN];
+  uint8_t suffix[MAX_DICT_LEN];
+  uint8_t first[MAX_DICT_LEN];
+} LZWTable;
+
+/* State of a decoding call, performed without the GVL */
+typedef struct
+{
+  const uint8_t *pData;
+  size_t dataLen;
+  size_t dataPos;
+  uint8_t blockLeft;
+  bool ended;
+  uint8_t *pOut;
+  uint32_t width;
+  uint32_t height;
+  bool interlace;
+  bool failed;
+} LZWDecodeCall;
+
+/* Fetch next byte of LZW data, transparently skipping the sub-block headers */
+static inline int nextByte(LZWDecodeCall *pCall)
+{
+  if (pCall->ended)
+    return -1;
+  if (!pCall->blockLeft) {
+    if (pCall->dataPos >= pCall->dataLen || !pCall->pData[pCall->dataPos]) {
+      pCall->ended = true;
+      return -1;
+    }
+    pCall->blockLeft = pCall->pData[pCall->dataPos++];
+  }
+  if (pCall->dataPos >= pCall->dataLen) {
+    pCall->ended = true;
+    return -1;
+  }
+  pCall->blockLeft--;
+  return pCall->pData[pCall->dataPos++];
+}
+
+/* Write the string of a code at the given position, clipping it to the output size */
+static inline void writeString(const LZWTable *pTable, uint8_t *pOut, uint32_t pos, uint32_t size, uint16_t code)
+{
+  uint32_t len = pTable->length[code];
+  uint32_t i = pos + len;
+
+  if (i <= size) {
+    while (i > pos) {
+      pOut[--i] = pTable->suffix[code];
+      code = pTable->prefix[code];
+    }
+  } else {
+    while (i > pos) {
+      if (--i < size) pOut[i] = pTable->suffix[code];
+      code = pTable->prefix[code];
+    }
+  }
+}
+
+/*
+  Decode a GIF LZW stream (minimum code size byte followed by the data sub-blocks)
+  into the output buffer. Corrupt and truncated streams are decoded as far as
+  possible, and the rest of the pixels are left as 0, like most decoders do.
+*/
+static uint32_t lzw_decode_raw(LZWDecodeCall *pCall, uint8_t *pOut, uint32_t size)
+{
+  LZWTable *pTable;
+  uint32_t pos = 0, acc = 0, i;
+  int byte, prev = -1;
+  uint16_t code, clear, eoi, next;
+  uint8_t minCodeSize, codeLen, bits = 0;
+
+  if (pCall->dataLen < 1 || pCall->pData[0] < 1 || pCall->pData[0] > 11)
+    return 0;
+  minCodeSize = pCall->pData[0];
+  pCall->dataPos = 1;
+  pTable = malloc(sizeof(LZWTable));
+  if (!pTable) {
+    pCall->failed = true;
+    return 0;
+  }
+
+  clear = 1u << minCodeSize;
+  eoi = clear + 1;
+  for (i = 0; i < clear; i++) {
+    pTable->prefix[i] = 0;
+    pTable->length[i] = 1;
+    pTable->suffix[i] = i;
+    pTable->first[i] = i;
+  }
+  next = clear + 2;
+  codeLen = minCodeSize + 1;
+
+  while (pos < size) {
+    // Read next code
+    while (bits < codeLen) {
+      if ((byte = nextByte(pCall)) < 0) goto done;
+      acc |= (uint32_t)byte << bits;
+      bits += 8;
+    }
+    code = acc & ((1u << codeLen) - 1);
+    acc >>= codeLen;
+    bits -= codeLen;
+
+    // Control codes
+    if (code == clear) {
+      next = clear + 2;
+      codeLen = minCodeSize + 1;
+      prev = -1;
+      continue;
+    }
+    if (code == eoi) break;
+
+    // Data codes
+    if (prev < 0) {
+      if (code >= clear) break;
+      pOut[pos++] = pTable->suffix[code];
+      prev = code;
+      continue;
+    }
+    if (code > next || (code == next && next >= MAX_DICT_LEN)) break;
+    if (next < MAX_DICT_LEN) {
+      pTable->prefix[next] = prev;
+      pTable->suffix[next] = pTable->first[code == next ? prev : code];
+      pTable->first[next] = pTable->first[prev];
+      pTable->length[next] = pTable->length[prev] + 1;
+      next++;
+      if (next == (1u << codeLen) && codeLen < MAX_CODE_LEN) codeLen++;
+    }
+    writeString(pTable, pOut, pos, size, code);
+    pos += pTable->length[code];
+    prev = code;
+  }
+
+done:
+  free(pTable);
+  return pos < size ? pos : size;
+}
+
+static void *lzw_decode_nogvl(void *ptr)
+{
+  LZWDecodeCall *pCall = ptr;
+  uint32_t size = pCall->width * pCall->height;
+  uint32_t len, row;
+  uint32_t *pRows;
+  uint8_t *pBuf;
+
+  if (!pCall->interlace || pCall->width == 0) {
+    len = lzw_decode_raw(pCall, pCall->pOut, size);
+    memset(pCall->pOut + len, 0, size - len);
+    return NULL;
+  }
+
+  // Interlaced rows come in 4 passes, decode them sequentially and then lay them out
+  pBuf = calloc(size, 1);
+  pRows = malloc((pCall->height ? pCall->height : 1) * sizeof(uint32_t));
+  if (!pBuf || !pRows) {
+    free(pBuf);
+    free(pRows);
+    pCall->failed = true;
+    return NULL;
+  }
+  lzw_decode_raw(pCall, pBuf, size);
+  interlace_rows(pRows, pCall->height);
+  for (row = 0; row < pCall->height; row++)
+    memcpy(pCall->pOut + pRows[row] * pCall->width, pBuf + row * pCall->width, pCall->width);
+  free(pBuf);
+  free(pRows);
+  return NULL;
+}
+
+static void check_dimensions(long w, long h)
+{
+  if (w < 0 || h < 0 || w > 0xFFFF || h > 0xFFFF)
+    rb_raise(rb_eArgError, "Invalid image dimensions.");
+}
+
+/* Decode LZW data into a new string of w * h pixels, returning Qnil if out of memory */
+static VALUE decode_pixels(const uint8_t *pData, size_t len, long w, long h, bool interlace)
+{
+  VALUE pixels = rb_str_new(NULL, w * h);
+  LZWDecodeCall call = {
+    .pData     = pData,
+    .dataLen   = len,
+    .pOut      = (uint8_t*)RSTRING_PTR(pixels),
+    .width     = w,
+    .height    = h,
+    .interlace = interlace
+  };
+  rb_thread_call_without_gvl(lzw_decode_nogvl, &call, NULL, NULL);
+  return call.failed ? Qnil : pixels;
+}
+
+/*
+  LZW-decode the table based image data of a GIF image (minimum code size byte
+  followed by the data sub-blocks, as produced by lzw_encode), returning a new
+  string with the width * height color indices. Interlaced data is laid out in
+  the normal row order. The decoding runs without holding the GVL.
+*/
+VALUE lzw_decode(int argc, VALUE* argv, VALUE self)
+{
+  VALUE data, opt_w, opt_h, opt_interlace;
+  rb_scan_args(argc, argv, "31", &data, &opt_w, &opt_h, &opt_interlace);
+  Check_Type(data, T_STRING);
+  long w = NUM2LONG(opt_w), h = NUM2LONG(opt_h);
+  check_dimensions(w, h);
+
+  data = rb_str_new_frozen(data);
+  VALUE pixels = decode_pixels((const uint8_t*)RSTRING_PTR(data), RSTRING_LEN(data), w, h, RTEST(opt_interlace));
+  RB_GC_GUARD(data);
+  if (NIL_P(pixels))
+    rb_memerror();
+  return pixels;
+}
+
+/* Skip a sequence of data sub-blocks, returning the offset past its terminator (or -1) */
+static long skip_subblocks(const uint8_t *str, long len, long pos)
+{
+  while (pos < len) {
+    if (!str[pos]) return pos + 1;
+    pos += str[pos] + 1;
+  }
+  return -1;
+}
+
+static uint16_t read_le16(const uint8_t *str)
+{
+  return str[0] | str[1] << 8;
+}
+
+/*
+  Scan the block structure of a GIF file in a single pass, without decompressing
+  anything, and return an index of it:
+    [width, height, flags, bg, ar, gct_offset, images, extensions]
+  where each image is
+    [gce_offset, x, y, width, height, flags, lct_offset, data_offset, data_end]
+  and each extension other than the Graphic Control Extension is
+    [label, offset, end]
+  All offsets within the data. Unrecognized bytes between blocks are skipped,
+  and a truncated last block is ignored.
+*/
+static VALUE scan_gif(const uint8_t *str, long len)
+{
+  VALUE e_decoder = rb_path2class("Gifenc::Exception::DecoderError");
+  if (len < 13 || (memcmp(str, "GIF89a", 6) && memcmp(str, "GIF87a", 6)))
+    rb_raise(e_decoder, "Not a GIF file.");
+
+  // Header, logical screen descriptor and global color table
+  uint8_t flags = str[10];
+  long pos = 13;
+  VALUE gct = Qnil;
+  if (flags & 0x80) {
+    gct = LONG2FIX(pos);
+    pos += 3 * (2 << (flags & 0b111));
+    if (pos > len) rb_raise(e_decoder, "Truncated global color table.");
+  }
+
+  VALUE images = rb_ary_new();
+  VALUE extensions = rb_ary_new();
+  VALUE gce = Qnil;
+  long end;
+  while (pos < len) {
+    switch (str[pos]) {
+    case ',': // Image descriptor, color table and data
+      if (pos + 11 > len) goto done;
+      uint8_t img_flags = str[pos + 9];
+      long lct = -1, offset = pos + 10;
+      if (img_flags & 0x80) {
+        lct = offset;
+        offset += 3 * (2 << (img_flags & 0b111));
+      }
+      if (offset >= len || (end = skip_subblocks(str, len, offset + 1)) < 0) goto done;
+      rb_ary_push(images, rb_ary_new_from_args(9,
+        gce,
+        INT2FIX(read_le16(str + pos + 1)), INT2FIX(read_le16(str + pos + 3)),
+        INT2FIX(read_le16(str + pos + 5)), INT2FIX(read_le16(str + pos + 7)),
+        INT2FIX(img_flags), lct < 0 ? Qnil : LONG2FIX(lct),
+        LONG2FIX(offset), LONG2FIX(end)
+      ));
+      gce = Qnil;
+      pos = end;
+      break;
+    case '!': // Extension
+      if (pos + 2 > len || (end = skip_subblocks(str, len, pos + 2)) < 0) goto done;
+      if (str[pos + 1] == 0xF9)
+        gce = LONG2FIX(pos);
+      else
+        rb_ary_push(extensions, rb_ary_new_from_args(3, INT2FIX(str[pos + 1]), LONG2FIX(pos), LONG2FIX(end)));
+      pos = end;
+      break;
+    case ';': // Trailer
+      goto done;
+    default: // Unrecognized, keep looking for a valid block
+      pos++;
+    }
+  }
+
+done:
+  return rb_ary_new_from_args(8,
+    INT2FIX(read_le16(str + 6)), INT2FIX(read_le16(str + 8)), INT2FIX(flags),
+    INT2FIX(str[11]), INT2FIX(str[12]), gct, images, extensions
+  );
+}
+
+/* Index the block structure of a GIF held in a string (see scan_gif) */
+VALUE gif_index(VALUE self, VALUE data)
+{
+  Check_Type(data, T_STRING);
+  data = rb_str_new_frozen(data);
+  VALUE index = scan_gif((const uint8_t*)RSTRING_PTR(data), RSTRING_LEN(data));
+  RB_GC_GUARD(data);
+  return index;
+}
+
+/* A GIF file mapped into memory (or fully read, where mmap is unavailable) */
+typedef struct
+{
+  uint8_t *pData;
+  size_t len;
+  bool open;
+  bool mapped;
+  int users;
+} GifReader;
+
+static void unmap_reader(GifReader *pReader)
+{
+  if (!pReader->open) return;
+#ifdef HAVE_SYS_MMAN_H
+  if (pReader->mapped)
+    munmap(pReader->pData, pReader->len);
+  else
+#endif
+    free(pReader->pData);
+  pReader->pData = NULL;
+  pReader->len = 0;
+  pReader->open = false;
+}
+
+static void gif_reader_free(void *ptr)
+{
+  unmap_reader(ptr);
+  xfree(ptr);
+}
+
+static size_t gif_reader_memsize(const void *ptr)
+{
+  const GifReader *pReader = ptr;
+  return sizeof(GifReader) + (pReader->mapped ? 0 : pReader->len);
+}
+
+static const rb_data_type_t gif_reader_type = {
+  "Gifenc::Reader",
+  { NULL, gif_reader_free, gif_reader_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+VALUE gif_reader_alloc(VALUE klass)
+{
+  GifReader *pReader;
+  return TypedData_Make_Struct(klass, GifReader, &gif_reader_type, pReader);
+}
+
+static GifReader *get_reader(VALUE self)
+{
+  GifReader *pReader;
+  TypedData_Get_Struct(self, GifReader, &gif_reader_type, pReader);
+  if (!pReader->open)
+    rb_raise(rb_eIOError, "Reader is closed.");
+  return pReader;
+}
+
+/* Check that a byte range lies within the file, returning a pointer to it */
+static const uint8_t *reader_range(GifReader *pReader, VALUE opt_offset, VALUE opt_len)
+{
+  long offset = NUM2LONG(opt_offset), len = NUM2LONG(opt_len);
+  if (offset < 0 || len < 0 || (size_t)offset > pReader->len || (size_t)len > pReader->len - offset)
+    rb_raise(rb_eRangeError, "Range out of the file bounds.");
+  return pReader->pData + offset;
+}
+
+/*
+  Open a GIF file for reading. The file is mapped into memory, so that only the
+  parts that are actually accessed get loaded by the OS. Where mmap is not
+  available, the file is read completely instead.
+*/
+VALUE gif_reader_initialize(VALUE self, VALUE filename)
+{
+  GifReader *pReader;
+  TypedData_Get_Struct(self, GifReader, &gif_reader_type, pReader);
+  if (pReader->open)
+    rb_raise(rb_eIOError, "Reader is already open.");
+  FilePathValue(filename);
+  const char *path = StringValueCStr(filename);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) rb_sys_fail(path);
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    rb_sys_fail(path);
+  }
+  pReader->len = st.st_size;
+  if (!pReader->len) {
+    close(fd);
+    pReader->open = true;
+    return self;
+  }
+
+#ifdef HAVE_SYS_MMAN_H
+  void *pMap = mmap(NULL, pReader->len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (pMap != MAP_FAILED) {
+    close(fd);
+    pReader->pData = pMap;
+    pReader->mapped = true;
+    pReader->open = true;
+    return self;
+  }
+#endif
+
+  pReader->pData = malloc(pReader->len);
+  if (!pReader->pData) {
+    close(fd);
+    rb_memerror();
+  }
+  size_t total = 0;
+  while (total < pReader->len) {
+    ssize_t n = read(fd, pReader->pData + total, pReader->len - total);
+    if (n <= 0) {
+      free(pReader->pData);
+      close(fd);
+      if (n == 0) rb_raise(rb_eIOError, "Unexpected end of file.");
+      rb_sys_fail(path);
+    }
+    total += n;
+  }
+  close(fd);
+  pReader->open = true;
+  return self;
+}
+
+/* Index the block structure of the file (see scan_gif) */
+VALUE gif_reader_index(VALUE self)
+{
+  GifReader *pReader = get_reader(self);
+  return scan_gif(pReader->pData, pReader->len);
+}
+
+/* Read a range of bytes of the file as a new binary string */
+VALUE gif_reader_read(VALUE self, VALUE offset, VALUE len)
+{
+  GifReader *pReader = get_reader(self);
+  const uint8_t *pData = reader_range(pReader, offset, len);
+  return rb_str_new((const char*)pData, NUM2LONG(len));
+}
+
+/* Arguments of a decode from a reader, passed through rb_ensure */
+typedef struct
+{
+  GifReader *pReader;
+  const uint8_t *pData;
+  long len, w, h;
+  bool interlace;
+} ReaderDecode;
+
+static VALUE reader_decode_body(VALUE arg)
+{
+  ReaderDecode *pArgs = (ReaderDecode*)arg;
+  return decode_pixels(pArgs->pData, pArgs->len, pArgs->w, pArgs->h, pArgs->interlace);
+}
+
+static VALUE reader_decode_done(VALUE arg)
+{
+  ((ReaderDecode*)arg)->pReader->users--;
+  return Qnil;
+}
+
+/* LZW-decode the image data found in a range of the file (see lzw_decode) */
+VALUE gif_reader_decode(VALUE self, VALUE offset, VALUE len, VALUE opt_w, VALUE opt_h, VALUE interlace)
+{
+  GifReader *pReader = get_reader(self);
+  const uint8_t *pData = reader_range(pReader, offset, len);
+  long w = NUM2LONG(opt_w), h = NUM2LONG(opt_h);
+  check_dimensions(w, h);
+  ReaderDecode args = { pReader, pData, NUM2LONG(len), w, h, RTEST(interlace) };
+
+  // Prevent the file from being closed while another thread decodes from it,
+  // releasing it even if decoding raises
+  pReader->users++;
+  VALUE pixels = rb_ensure(reader_decode_body, (VALUE)&args, reader_decode_done, (VALUE)&args);
+  RB_GC_GUARD(self);
+  if (NIL_P(pixels))
+    rb_memerror();
+  return pixels;
+}
+
+/* Size of the file in bytes */
+VALUE gif_reader_size(VALUE self)
+{
+  return SIZET2NUM(get_reader(self)->len);
+}
+
+/* Unmap the file. Any further access raises an IOError */
+VALUE gif_reader_close(VALUE self)
+{
+  GifReader *pReader;
+  TypedData_Get_Struct(self, GifReader, &gif_reader_type, pReader);
+  if (pReader->users)
+    rb_raise(rb_eIOError, "Reader is being used by another thread.");
+  unmap_reader(pReader);
+  return Qnil;
+}
+
+VALUE gif_reader_closed(VALUE self)
+{
+  GifReader *pReader;
+  TypedData_Get_Struct(self, GifReader, &gif_reader_type, pReader);
+  return pReader->open ? Qfalse : Qtrue;
+}
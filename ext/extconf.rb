@@ -1,3 +1,5 @@
 require 'mkmf'
 $CFLAGS << ' -Wall -O3'
+have_header('sys/mman.h')
+have_header('sched.h')
 create_makefile('cgifenc')
\ No newline at end of file
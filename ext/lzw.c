@@ -7,27 +7,133 @@
 
 #define MAX_CODE_LEN 12
 #define MAX_DICT_LEN (1uL << MAX_CODE_LEN)
+#define MAX_INIT_DICT_LEN 256
 #define BLOCK_SIZE 0xFF
 
-typedef struct
-{
-  uint8_t *pRasterData;
-  uint32_t sizeRasterData;
-} LZWResult;
+/* Amount of compressed bytes to accumulate before flushing them to an output stream */
+#define FLUSH_SIZE (256 * (BLOCK_SIZE + 1))
+
+/* Compression strategies (see lzw_encoder_encode) */
+#define LZW_STANDARD 0
+#define LZW_DEFERRED 1
+#define LZW_FAST     2
+
+/*
+  Smallest code size for which the fast strategy is used. Literal codes take at
+  least 3 bits per pixel plus a clear code every few ones, so with fewer bits
+  they're larger than LZW even on pure noise, and the standard one is used.
+*/
+#define FAST_MIN_BITS 6
 
+/* Amount of pixels between compression ratio checks once the dictionary is full */
+#define CHECK_GAP 10000
+
+/*
+  The encoder context is persistent: it is allocated once (either explicitly as a
+  Gifenc::LZWEncoder object or implicitly as the default encoder used by
+  Gifenc.lzw_encode) and reused for every frame. The dictionary tables are always
+  allocated for the largest possible initial dictionary, the output buffer only
+  grows when a bigger frame comes along, and every dictionary reset only clears
+  the entries that were actually written since the previous one, which are
+  tracked in pTouched (for pTreeInit) and by the final dictPos (for pTreeList).
+
+  With the deferred strategy, a full dictionary is kept rather than cleared, and
+  the compression ratio achieved since the last clear is checked every CHECK_GAP
+  pixels, as done by Unix compress: the dictionary is only cleared once the ratio
+  worsens, i.e., when it's no longer suited to the data. bitsOut counts the bits
+  written since the last clear for this purpose. The fast strategy doesn't build
+  a dictionary at all, every pixel is written as a literal code, and a clear code
+  is inserted just before the decoder's dictionary would make the codes longer.
+
+  For instrumentation, the codes and clear codes written are counted as they're
+  emitted, which is just as cheap as checking whether that's needed.
+
+  Interlaced images are fed to the encoder through a table with the order of
+  the rows (see interlace_rows), so the pixels are never copied.
+
+  Codes are not stored: each one is packed into a bit accumulator as soon as it's
+  generated, and the resulting bytes are laid directly into 255-byte sub-blocks
+  in the output buffer. When an output stream is provided, the buffer is flushed
+  to it every FLUSH_SIZE bytes, so it never holds more than that.
+*/
 typedef struct
 {
   uint16_t *pTreeInit;
   uint16_t *pTreeList;
   uint16_t *pTreeMap;
-  uint16_t *pLZWData;
+  uint32_t *pTouched;
+  uint8_t *pOut;
+  size_t capOut;
+  size_t outLen;
+  size_t blockPos;
+  size_t outTotal;
   const uint8_t *pImageData;
+  const uint32_t *pRows;
+  uint32_t width;
   uint32_t numPixel;
-  uint32_t LZWPos;
+  uint64_t bitsOut;
+  uint64_t numCodes;
+  uint32_t numClears;
+  uint32_t bitAcc;
+  uint8_t bitCount;
+  uint8_t codeLen;
+  uint8_t initCodeLen;
+  uint16_t codeLimit;
+  uint16_t codeCount;
+  uint16_t initDictLen;
   uint16_t dictPos;
   uint16_t mapPos;
+  uint16_t numTouched;
+  uint8_t strategy;
+  VALUE stream;
+  int flushState;
+  bool failed;
+  bool busy;
 } LZWGenState;
 
+/* Arguments and result of an encoding call performed without the GVL */
+typedef struct
+{
+  LZWGenState *pContext;
+  const uint8_t *pImageData;
+  const uint32_t *pRows;
+  uint32_t width;
+  uint32_t numPixel;
+  uint8_t bits;
+  uint8_t strategy;
+  int r;
+} LZWCall;
+
+/*
+  Fill a table with the order in which the rows of an interlaced image are
+  stored: every 8th row starting with the 1st, every 8th starting with the
+  5th, every 4th starting with the 3rd, and finally every 2nd starting with
+  the 2nd. Shared by the encoder and the decoder.
+*/
+void interlace_rows(uint32_t *pRows, uint32_t height)
+{
+  uint32_t pass, row, step, n = 0;
+
+  for (pass = 0; pass < 4; pass++)
+  {
+    step = pass == 0 ? 8 : 16 >> pass;
+    for (row = pass == 0 ? 0 : step / 2; row < height; row += step)
+    {
+      pRows[n++] = row;
+    }
+  }
+}
+
+/* Pixel at a position of the encoding order, following the row table if any */
+static inline uint8_t pixelAt(const LZWGenState *pContext, uint32_t pos)
+{
+  if (!pContext->pRows)
+  {
+    return pContext->pImageData[pos];
+  }
+  return pContext->pImageData[pContext->pRows[pos / pContext->width] * pContext->width + pos % pContext->width];
+}
+
 static uint8_t calcNextPower2Ex(uint16_t n)
 {
   uint8_t nextPow2;
@@ -44,15 +150,111 @@ static uint8_t calcInitCodeLen(uint16_t numEntries)
   return (index < 3) ? 3 : index + 1;
 }
 
+static VALUE flushStream(VALUE arg)
+{
+  LZWGenState *pContext = (LZWGenState*)arg;
+
+  rb_funcall(pContext->stream, rb_intern("<<"), 1, rb_str_new((const char*)pContext->pOut, pContext->outLen));
+  return Qnil;
+}
+
+static void *flushStreamWithGVL(void *ptr)
+{
+  LZWGenState *pContext = ptr;
+
+  rb_protect(flushStream, (VALUE)pContext, &pContext->flushState);
+  return NULL;
+}
+
+/* Close the current sub-block and open a new one, making room or flushing as needed */
+static void nextBlock(LZWGenState *pContext)
+{
+  uint8_t *pOut;
+  size_t capOut;
+
+  pContext->pOut[pContext->blockPos] = BLOCK_SIZE;
+  if (!NIL_P(pContext->stream) && pContext->outLen >= FLUSH_SIZE && !pContext->flushState)
+  {
+    rb_thread_call_with_gvl(flushStreamWithGVL, pContext);
+    pContext->outTotal += pContext->outLen;
+    pContext->outLen = 0;
+  }
+  if (pContext->outLen + BLOCK_SIZE + 2 > pContext->capOut)
+  {
+    capOut = 2 * pContext->capOut;
+    pOut = realloc(pContext->pOut, capOut);
+    if (!pOut)
+    {
+      pContext->failed = true;
+      pContext->outLen = pContext->blockPos;
+      return;
+    }
+    pContext->pOut = pOut;
+    pContext->capOut = capOut;
+  }
+  pContext->blockPos = pContext->outLen++;
+}
+
+static inline void emitByte(LZWGenState *pContext, uint8_t byte)
+{
+  if (pContext->failed)
+  {
+    return;
+  }
+  pContext->pOut[pContext->outLen++] = byte;
+  if (pContext->outLen - pContext->blockPos > BLOCK_SIZE)
+  {
+    nextBlock(pContext);
+  }
+}
+
+/* Pack one code into the output, growing the code length as the dictionary does */
+static inline void emitCode(LZWGenState *pContext, uint16_t code)
+{
+  if ((pContext->codeLen < MAX_CODE_LEN) && (pContext->codeLimit == pContext->codeCount))
+  {
+    ++(pContext->codeLen);
+    pContext->codeLimit = 2 * pContext->codeLimit + pContext->initDictLen;
+  }
+  pContext->bitAcc |= (uint32_t)code << pContext->bitCount;
+  pContext->bitCount += pContext->codeLen;
+  pContext->bitsOut += pContext->codeLen;
+  while (pContext->bitCount >= 8)
+  {
+    emitByte(pContext, (uint8_t)pContext->bitAcc);
+    pContext->bitAcc >>= 8;
+    pContext->bitCount -= 8;
+  }
+  ++(pContext->codeCount);
+  ++(pContext->numCodes);
+  if (code == pContext->initDictLen)
+  {
+    ++(pContext->numClears);
+    pContext->codeLen = pContext->initCodeLen;
+    pContext->codeLimit = pContext->initDictLen;
+    pContext->codeCount = 1;
+  }
+}
+
+static void clearDict(LZWGenState *pContext)
+{
+  uint16_t i;
+
+  for (i = 0; i < pContext->numTouched; ++i)
+  {
+    pContext->pTreeInit[pContext->pTouched[i]] = 0;
+  }
+  pContext->numTouched = 0;
+  memset(pContext->pTreeList, 0, ((sizeof(uint16_t) * 2) + sizeof(uint16_t)) * pContext->dictPos);
+}
+
 static void resetDict(LZWGenState *pContext, const uint16_t initDictLen)
 {
+  clearDict(pContext);
   pContext->dictPos = initDictLen + 2;
   pContext->mapPos = 1;
-  pContext->pLZWData[pContext->LZWPos] = initDictLen;
-  ++(pContext->LZWPos);
-
-  memset(pContext->pTreeInit, 0, initDictLen * sizeof(uint16_t) * initDictLen);
-  memset(pContext->pTreeList, 0, ((sizeof(uint16_t) * 2) + sizeof(uint16_t)) * MAX_DICT_LEN);
+  emitCode(pContext, initDictLen);
+  pContext->bitsOut = 0;
 }
 
 static void add_child(LZWGenState *pContext, const uint16_t parentIndex, const uint16_t LZWIndex, const uint16_t initDictLen, const uint8_t nextColor)
@@ -93,6 +295,7 @@ static int lzw_crawl_tree(LZWGenState *pContext, uint32_t *pStrPos, uint16_t par
   uint32_t strPos;
   uint16_t nextParent;
   uint16_t mapPos;
+  uint8_t next;
 
   if (parentIndex >= initDictLen)
   {
@@ -104,11 +307,12 @@ static int lzw_crawl_tree(LZWGenState *pContext, uint32_t *pStrPos, uint16_t par
 
   if (strPos < (pContext->numPixel - 1))
   {
-    if (pContext->pImageData[strPos + 1] >= initDictLen)
+    next = pixelAt(pContext, strPos + 1);
+    if (next >= initDictLen)
     {
       return 1;
     }
-    nextParent = pTreeInit[parentIndex * initDictLen + pContext->pImageData[strPos + 1]];
+    nextParent = pTreeInit[parentIndex * initDictLen + next];
     if (nextParent)
     {
       parentIndex = nextParent;
@@ -116,14 +320,14 @@ static int lzw_crawl_tree(LZWGenState *pContext, uint32_t *pStrPos, uint16_t par
     }
     else
     {
-      pContext->pLZWData[pContext->LZWPos] = parentIndex;
-      ++(pContext->LZWPos);
+      emitCode(pContext, parentIndex);
       if (pContext->dictPos < MAX_DICT_LEN)
       {
-        pTreeInit[parentIndex * initDictLen + pContext->pImageData[strPos + 1]] = pContext->dictPos;
+        pContext->pTouched[pContext->numTouched++] = parentIndex * initDictLen + next;
+        pTreeInit[parentIndex * initDictLen + next] = pContext->dictPos;
         ++(pContext->dictPos);
       }
-      else
+      else if (pContext->strategy == LZW_STANDARD)
       {
         resetDict(pContext, initDictLen);
       }
@@ -135,12 +339,13 @@ static int lzw_crawl_tree(LZWGenState *pContext, uint32_t *pStrPos, uint16_t par
 
   while (strPos < (pContext->numPixel - 1))
   {
-    if (pContext->pImageData[strPos + 1] >= initDictLen)
+    next = pixelAt(pContext, strPos + 1);
+    if (next >= initDictLen)
     {
       return 1;
     }
 
-    if (pTreeList[parentIndex * (2 + 1) + 2] && pTreeList[parentIndex * (2 + 1) + 1] == pContext->pImageData[strPos + 1])
+    if (pTreeList[parentIndex * (2 + 1) + 2] && pTreeList[parentIndex * (2 + 1) + 1] == next)
     {
       parentIndex = pTreeList[parentIndex * (2 + 1) + 2];
       ++strPos;
@@ -150,7 +355,7 @@ static int lzw_crawl_tree(LZWGenState *pContext, uint32_t *pStrPos, uint16_t par
     mapPos = pContext->pTreeList[parentIndex * (2 + 1)];
     if (mapPos)
     {
-      nextParent = pContext->pTreeMap[(mapPos - 1) * initDictLen + pContext->pImageData[strPos + 1]];
+      nextParent = pContext->pTreeMap[(mapPos - 1) * initDictLen + next];
       if (nextParent)
       {
         parentIndex = nextParent;
@@ -159,196 +364,381 @@ static int lzw_crawl_tree(LZWGenState *pContext, uint32_t *pStrPos, uint16_t par
       }
     }
 
-    pContext->pLZWData[pContext->LZWPos] = parentIndex;
-    ++(pContext->LZWPos);
+    emitCode(pContext, parentIndex);
     if (pContext->dictPos < MAX_DICT_LEN)
     {
-      add_child(pContext, parentIndex, pContext->dictPos, initDictLen, pContext->pImageData[strPos + 1]);
+      add_child(pContext, parentIndex, pContext->dictPos, initDictLen, next);
     }
-    else
+    else if (pContext->strategy == LZW_STANDARD)
     {
-
       resetDict(pContext, initDictLen);
     }
     ++strPos;
     *pStrPos = strPos;
     return 0;
   }
-  pContext->pLZWData[pContext->LZWPos] = parentIndex;
-  ++(pContext->LZWPos);
+  emitCode(pContext, parentIndex);
   ++strPos;
   *pStrPos = strPos;
   return 0;
 }
 
+/* Write every pixel as a literal code, clearing often enough to keep the codes short */
+static int lzw_generate_literal(LZWGenState *pContext, uint16_t initDictLen)
+{
+  uint32_t strPos;
+  uint8_t pixel;
+
+  emitCode(pContext, initDictLen);
+  for (strPos = 0; strPos < pContext->numPixel; ++strPos)
+  {
+    pixel = pixelAt(pContext, strPos);
+    if (pixel >= initDictLen)
+    {
+      return 1;
+    }
+    if (pContext->codeCount == initDictLen - 1)
+    {
+      emitCode(pContext, initDictLen);
+    }
+    emitCode(pContext, pixel);
+    if (pContext->failed || pContext->flushState)
+    {
+      return 2;
+    }
+  }
+  emitCode(pContext, initDictLen + 1);
+  return 0;
+}
+
 static int lzw_generate(LZWGenState *pContext, uint16_t initDictLen)
 {
   uint32_t strPos;
+  uint32_t clearPos;
+  uint32_t nextCheck;
+  double ratio;
+  double bestRatio;
   int r;
   uint8_t parentIndex;
 
-  strPos = 0;
+  if (pContext->strategy == LZW_FAST)
+  {
+    return lzw_generate_literal(pContext, initDictLen);
+  }
+  strPos = clearPos = nextCheck = 0;
+  bestRatio = 0;
   resetDict(pContext, initDictLen);
   while (strPos < pContext->numPixel)
   {
-    parentIndex = pContext->pImageData[strPos];
+    parentIndex = pixelAt(pContext, strPos);
 
     r = lzw_crawl_tree(pContext, &strPos, (uint16_t)parentIndex, initDictLen);
     if (r != 0)
     {
       return r;
     }
-  }
-  pContext->pLZWData[pContext->LZWPos] = initDictLen + 1;
-  ++(pContext->LZWPos);
-  return 0;
-}
-
-static uint32_t create_byte_list(uint8_t *byteList, uint32_t lzwPos, uint16_t *lzwStr, uint16_t initDictLen, uint8_t initCodeLen)
-{
-  uint32_t i;
-  uint32_t dictPos;
-  uint16_t n = 2 * initDictLen;
-  uint32_t bytePos = 0;
-  uint8_t bitOffset = 0;
-  uint8_t lzwCodeLen = initCodeLen;
-  int correctLater = 0;
-
-  byteList[0] = 0;
-
-  dictPos = 1;
-  for (i = 0; i < lzwPos; ++i)
-  {
-    if ((lzwCodeLen < MAX_CODE_LEN) && ((uint32_t)(n - (initDictLen)) == dictPos))
+    if (pContext->failed || pContext->flushState)
     {
-      ++lzwCodeLen;
-      n *= 2;
+      return 2;
     }
-    correctLater = 0;
-    byteList[bytePos] |= ((uint8_t)(lzwStr[i] << bitOffset));
-    if (lzwCodeLen + bitOffset >= 8)
+
+    // Clear a full dictionary only once the compression ratio starts dropping
+    if (pContext->strategy == LZW_DEFERRED && pContext->dictPos >= MAX_DICT_LEN && strPos >= nextCheck)
     {
-      if (lzwCodeLen + bitOffset == 8)
-      {
-        byteList[++bytePos] = 0;
-        correctLater = 1;
-      }
-      else if (lzwCodeLen + bitOffset < 16)
+      nextCheck = strPos + CHECK_GAP;
+      ratio = (double)(strPos - clearPos) / pContext->bitsOut;
+      if (ratio >= bestRatio)
       {
-        byteList[++bytePos] = (uint8_t)(lzwStr[i] >> (8 - bitOffset));
-      }
-      else if (lzwCodeLen + bitOffset == 16)
-      {
-        byteList[++bytePos] = (uint8_t)(lzwStr[i] >> (8 - bitOffset));
-        byteList[++bytePos] = 0;
-        correctLater = 1;
+        bestRatio = ratio;
       }
       else
       {
-        byteList[++bytePos] = (uint8_t)(lzwStr[i] >> (8 - bitOffset));
-        byteList[++bytePos] = (uint8_t)(lzwStr[i] >> (16 - bitOffset));
+        resetDict(pContext, initDictLen);
+        clearPos = strPos;
+        nextCheck = 0;
+        bestRatio = 0;
       }
     }
-    bitOffset = (lzwCodeLen + bitOffset) % 8;
-    ++dictPos;
-    if (lzwStr[i] == initDictLen)
-    {
-      lzwCodeLen = initCodeLen;
-      n = 2 * initDictLen;
-      dictPos = 1;
-    }
+  }
+  emitCode(pContext, initDictLen + 1);
+  return 0;
+}
+
+/* Output must have room for one sub-block, since this runs without the GVL */
+static int LZW_GenerateStream(LZWGenState *pContext, const uint32_t numPixel, const uint8_t *pImageData, const uint32_t *pRows, const uint32_t width, const uint8_t strategy, const uint16_t initDictLen, const uint8_t initCodeLen)
+{
+  int r;
+
+  pContext->numPixel = numPixel;
+  pContext->pImageData = pImageData;
+  pContext->pRows = pRows;
+  pContext->width = width;
+  pContext->strategy = strategy;
+  pContext->initDictLen = initDictLen;
+  pContext->initCodeLen = initCodeLen;
+  pContext->codeLen = initCodeLen;
+  pContext->codeLimit = initDictLen;
+  pContext->codeCount = 1;
+  pContext->bitAcc = 0;
+  pContext->bitCount = 0;
+  pContext->bitsOut = 0;
+  pContext->numCodes = 0;
+  pContext->numClears = 0;
+  pContext->pOut[0] = initCodeLen - 1;
+  pContext->outLen = 2;
+  pContext->blockPos = 1;
+  pContext->outTotal = 0;
+  pContext->flushState = 0;
+  pContext->failed = false;
+
+  r = lzw_generate(pContext, initDictLen);
+  if (r != 0)
+  {
+    return r;
   }
 
-  if (correctLater)
+  // Flush the last partial byte and close the last sub-block
+  if (pContext->bitCount > 0)
+  {
+    emitByte(pContext, (uint8_t)pContext->bitAcc);
+  }
+  if (pContext->failed)
   {
-    --bytePos;
+    return 2;
   }
-  return bytePos;
+  if (pContext->outLen - pContext->blockPos > 1)
+  {
+    pContext->pOut[pContext->blockPos] = pContext->outLen - pContext->blockPos - 1;
+    pContext->pOut[pContext->outLen++] = 0;
+  }
+  else
+  {
+    pContext->pOut[pContext->blockPos] = 0;
+  }
+  return 0;
 }
 
-static uint32_t create_byte_list_block(uint8_t *byteList, uint8_t *byteListBlock, const uint32_t numBytes)
+/* Find the bit depth actually needed to represent every color index in the data */
+static uint8_t calcBitDepth(const uint8_t *pImageData, const uint32_t numPixel)
 {
   uint32_t i;
-  uint32_t numBlock = numBytes / BLOCK_SIZE;
-  uint8_t numRest = numBytes % BLOCK_SIZE;
+  uint8_t bits = 0;
+  uint8_t mask = 0;
 
-  for (i = 0; i < numBlock; ++i)
+  for (i = 0; i < numPixel; ++i)
   {
-    byteListBlock[i * (BLOCK_SIZE + 1)] = BLOCK_SIZE;
-    memcpy(byteListBlock + 1 + i * (BLOCK_SIZE + 1), byteList + i * BLOCK_SIZE, BLOCK_SIZE);
+    mask |= pImageData[i];
   }
-  if (numRest > 0)
+  while (mask >> bits)
   {
-    byteListBlock[numBlock * (BLOCK_SIZE + 1)] = numRest;
-    memcpy(byteListBlock + 1 + numBlock * (BLOCK_SIZE + 1), byteList + numBlock * BLOCK_SIZE, numRest);
-    byteListBlock[1 + numBlock * (BLOCK_SIZE + 1) + numRest] = 0;
-    return 1 + numBlock * (BLOCK_SIZE + 1) + numRest;
+    ++bits;
   }
+  return bits;
+}
 
-  byteListBlock[numBlock * (BLOCK_SIZE + 1)] = 0;
-  return numBlock * (BLOCK_SIZE + 1);
+static void *LZW_GenerateStreamNoGVL(void *ptr)
+{
+  LZWCall *pCall = ptr;
+  uint8_t bits = pCall->bits;
+  uint8_t initCodeLen;
+  uint8_t strategy;
+  uint16_t initDictLen;
+
+  // Never use a code size too small for the indices actually present in the data
+  if (bits < 8)
+  {
+    uint8_t depth = calcBitDepth(pCall->pImageData, pCall->numPixel);
+    bits = depth > bits ? depth : bits;
+  }
+  strategy = pCall->strategy == LZW_FAST && bits < FAST_MIN_BITS ? LZW_STANDARD : pCall->strategy;
+  initCodeLen = calcInitCodeLen(1u << bits);
+  initDictLen = 1uL << (initCodeLen - 1);
+  pCall->r = LZW_GenerateStream(pCall->pContext, pCall->numPixel, pCall->pImageData, pCall->pRows, pCall->width, strategy, initDictLen, initCodeLen);
+  return NULL;
 }
 
-static int LZW_GenerateStream(LZWResult *pResult, const uint32_t numPixel, const uint8_t *pImageData, const uint16_t initDictLen, const uint8_t initCodeLen)
+static void lzw_encoder_free(void *ptr)
 {
-  LZWGenState *pContext;
-  uint32_t lzwPos, bytePos;
-  uint32_t bytePosBlock;
-  int r;
+  LZWGenState *pContext = ptr;
+
+  xfree(pContext->pTreeInit);
+  xfree(pContext->pTreeList);
+  xfree(pContext->pTreeMap);
+  xfree(pContext->pTouched);
+  free(pContext->pOut);
+  xfree(pContext);
+}
 
-  pContext = malloc(sizeof(LZWGenState));
-  pContext->pTreeInit = malloc((initDictLen * sizeof(uint16_t)) * initDictLen);
-  pContext->pTreeList = malloc(((sizeof(uint16_t) * 2) + sizeof(uint16_t)) * MAX_DICT_LEN);
-  pContext->pTreeMap = malloc(((MAX_DICT_LEN / 2) + 1) * (initDictLen * sizeof(uint16_t)));
-  pContext->numPixel = numPixel;
-  pContext->pImageData = pImageData;
-  pContext->pLZWData = malloc(sizeof(uint16_t) * (numPixel + 2));
-  pContext->LZWPos = 0;
+static size_t lzw_encoder_memsize(const void *ptr)
+{
+  const LZWGenState *pContext = ptr;
+
+  return sizeof(LZWGenState)
+    + MAX_INIT_DICT_LEN * MAX_INIT_DICT_LEN * sizeof(uint16_t)
+    + ((sizeof(uint16_t) * 2) + sizeof(uint16_t)) * MAX_DICT_LEN
+    + ((MAX_DICT_LEN / 2) + 1) * (MAX_INIT_DICT_LEN * sizeof(uint16_t))
+    + MAX_DICT_LEN * sizeof(uint32_t)
+    + pContext->capOut;
+}
 
-  r = lzw_generate(pContext, initDictLen);
-  if (r != 0)
-  {
-    goto LZWGENERATE_Cleanup;
-  }
-  lzwPos = pContext->LZWPos;
-
-  uint8_t *byteList;
-  uint8_t *byteListBlock;
-  uint64_t MaxByteListLen = MAX_CODE_LEN * lzwPos / 8ul + 2ul + 1ul;
-  uint64_t MaxByteListBlockLen = MAX_CODE_LEN * lzwPos * (BLOCK_SIZE + 1ul) / 8ul / BLOCK_SIZE + 2ul + 1ul + 1ul;
-  byteList = malloc(MaxByteListLen);
-  byteListBlock = malloc(MaxByteListBlockLen);
-  bytePos = create_byte_list(byteList, lzwPos, pContext->pLZWData, initDictLen, initCodeLen);
-  bytePosBlock = create_byte_list_block(byteList, byteListBlock, bytePos + 1);
-  free(byteList);
-  pResult->sizeRasterData = bytePosBlock + 1;
-  pResult->pRasterData = byteListBlock;
-LZWGENERATE_Cleanup:
-  free(pContext->pLZWData);
-  free(pContext->pTreeInit);
-  free(pContext->pTreeList);
-  free(pContext->pTreeMap);
-  free(pContext);
-  return r;
+static const rb_data_type_t lzw_encoder_type = {
+  "Gifenc::LZWEncoder",
+  { NULL, lzw_encoder_free, lzw_encoder_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/* The encoder used by Gifenc.lzw_encode, created on first use */
+static VALUE default_encoder = Qnil;
+
+/* Allocate a new encoder context, with zeroed dictionary tables */
+VALUE lzw_encoder_alloc(VALUE klass)
+{
+  LZWGenState *pContext;
+  VALUE obj = TypedData_Make_Struct(klass, LZWGenState, &lzw_encoder_type, pContext);
+
+  pContext->pTreeInit = ZALLOC_N(uint16_t, MAX_INIT_DICT_LEN * MAX_INIT_DICT_LEN);
+  pContext->pTreeList = ZALLOC_N(uint16_t, (2 + 1) * MAX_DICT_LEN);
+  pContext->pTreeMap = ALLOC_N(uint16_t, ((MAX_DICT_LEN / 2) + 1) * MAX_INIT_DICT_LEN);
+  pContext->pTouched = ALLOC_N(uint32_t, MAX_DICT_LEN);
+  pContext->capOut = FLUSH_SIZE + 2 * (BLOCK_SIZE + 1);
+  pContext->pOut = malloc(pContext->capOut);
+  pContext->stream = Qnil;
+  if (!pContext->pOut)
+    rb_memerror();
+  return obj;
 }
 
-/* LZW-encode a binary string honoring GIF's specs and build a Ruby string */
-VALUE lzw_encode(VALUE self, VALUE data)
+/*
+  LZW-encode a binary string honoring GIF's specs using the given encoder context.
+  The result is the LZW minimum code size byte followed by the sequence of data
+  sub-blocks, including the block terminator, i.e., the full table based image
+  data. The code size is chosen based on the "bits" keyword (the bit size of the
+  color table, 8 by default), but it's raised if the data contains larger indices.
+  If the "interlace" keyword is given, it's the width of the image, whose rows
+  are then encoded in interlaced order (see interlace_rows). The "strategy"
+  keyword selects how the dictionary is managed: :standard (default) clears it
+  as soon as it's full, :deferred keeps a full dictionary until the compression
+  ratio drops, which is usually smaller for large frames, and :fast writes raw
+  literal codes, which is much faster but only sensible for noisy data, where
+  LZW barely compresses anyway (and it falls back to :standard for code sizes
+  below FAST_MIN_BITS). If an output stream is provided, the data is
+  appended to it progressively and the amount of bytes written is returned,
+  otherwise a new string is returned.
+  If a hash is given as the "stats" keyword, it's filled with the amount of
+  codes written (:codes), of dictionary resets besides the initial clear code
+  (:resets), the time spent compressing in seconds (:lzw_time) and the size
+  of the encoder's output buffer (:peak_buffer). Nothing is timed otherwise.
+  The compression itself runs without the GVL on a frozen snapshot of the data,
+  so that several frames can be encoded concurrently from different threads, as
+  long as each of them uses its own encoder.
+*/
+VALUE lzw_encoder_encode(int argc, VALUE* argv, VALUE self)
 {
   // Parse input
+  VALUE data, stream, opts, opt_bits, opt_interlace, opt_strategy, opt_stats;
+  rb_scan_args(argc, argv, "11:", &data, &stream, &opts);
   if (!RB_TYPE_P(data, T_STRING))
     rb_raise(rb_eRuntimeError, "No data to LZW encode.");
-  uint8_t *str = (uint8_t*)RSTRING_PTR(data);
-  long len = RSTRING_LEN(data);
+  opt_bits = opt_interlace = opt_strategy = opt_stats = Qundef;
+  if (!NIL_P(opts)) {
+    ID kwargs[4] = { rb_intern("bits"), rb_intern("interlace"), rb_intern("strategy"), rb_intern("stats") };
+    VALUE values[4];
+    rb_get_kwargs(opts, kwargs, 0, 4, values);
+    opt_bits = values[0];
+    opt_interlace = values[1];
+    opt_strategy = values[2];
+    opt_stats = values[3];
+  }
+  bool stats = opt_stats != Qundef && RB_TYPE_P(opt_stats, T_HASH);
+  int bits = opt_bits == Qundef || NIL_P(opt_bits) ? 8 : NUM2INT(opt_bits);
+  long width = opt_interlace == Qundef || !RTEST(opt_interlace) ? 0 : NUM2LONG(opt_interlace);
+  uint8_t strategy = LZW_STANDARD;
+  if (opt_strategy != Qundef && !NIL_P(opt_strategy)) {
+    ID id = rb_sym2id(rb_to_symbol(opt_strategy));
+    if (id == rb_intern("deferred"))
+      strategy = LZW_DEFERRED;
+    else if (id == rb_intern("fast"))
+      strategy = LZW_FAST;
+    else if (id != rb_intern("standard"))
+      rb_raise(rb_eArgError, "Unknown LZW strategy %" PRIsVALUE ".", opt_strategy);
+  }
+  LZWGenState *pContext;
+  TypedData_Get_Struct(self, LZWGenState, &lzw_encoder_type, pContext);
+  if (pContext->busy)
+    rb_raise(rb_eRuntimeError, "LZW encoder is already in use by another thread.");
+  if (width < 0 || (width > 0 && RSTRING_LEN(data) % width))
+    rb_raise(rb_eArgError, "Interlaced data must be made of whole rows.");
+  data = rb_str_new_frozen(data);
+
+  // Row order of interlaced images
+  uint32_t *pRows = NULL;
+  if (width > 0) {
+    uint32_t height = RSTRING_LEN(data) / width;
+    pRows = ALLOC_N(uint32_t, height > 0 ? height : 1);
+    interlace_rows(pRows, height);
+  }
 
   // Encode data
-  LZWResult encResult;
-  uint8_t initCodeLen = calcInitCodeLen(256);
-  uint16_t initDictLen = 1uL << (initCodeLen - 1);
-  LZW_GenerateStream(&encResult, len, str, initDictLen, initCodeLen);
+  LZWCall call;
+  call.pContext = pContext;
+  call.pImageData = (const uint8_t*)RSTRING_PTR(data);
+  call.pRows = pRows;
+  call.width = width;
+  call.numPixel = RSTRING_LEN(data);
+  call.bits = bits < 1 ? 1 : bits > 8 ? 8 : bits;
+  call.strategy = strategy;
+  struct timespec t0, t1;
+  pContext->stream = stream;
+  pContext->busy = true;
+  if (stats)
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+  rb_thread_call_without_gvl(LZW_GenerateStreamNoGVL, &call, NULL, NULL);
+  if (stats)
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+  pContext->busy = false;
+  pContext->stream = Qnil;
+  xfree(pRows);
+  RB_GC_GUARD(data);
+  RB_GC_GUARD(self);
+  if (pContext->flushState)
+    rb_jump_tag(pContext->flushState);
+  if (pContext->failed)
+    rb_memerror();
+  if (call.r != 0)
+    rb_raise(rb_eRuntimeError, "Failed to LZW encode data.");
+
+  // Instrumentation
+  if (stats) {
+    rb_hash_aset(opt_stats, ID2SYM(rb_intern("codes")), ULL2NUM(pContext->numCodes));
+    rb_hash_aset(opt_stats, ID2SYM(rb_intern("resets")), UINT2NUM(pContext->numClears - 1));
+    rb_hash_aset(opt_stats, ID2SYM(rb_intern("lzw_time")), DBL2NUM((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9));
+    rb_hash_aset(opt_stats, ID2SYM(rb_intern("peak_buffer")), SIZET2NUM(pContext->capOut));
+  }
 
   // Build output
-  VALUE rb_str = rb_str_new((const char*) encResult.pRasterData, encResult.sizeRasterData);
-  free(encResult.pRasterData);
-  return rb_str;
-}
\ No newline at end of file
+  VALUE rb_str = rb_str_new((const char*) pContext->pOut, pContext->outLen);
+  if (NIL_P(stream))
+    return rb_str;
+  rb_funcall(stream, rb_intern("<<"), 1, rb_str);
+  return ULL2NUM(pContext->outTotal + pContext->outLen);
+}
+
+/*
+  LZW-encode a binary string honoring GIF's specs, either building a Ruby string
+  or writing to a stream (see lzw_encoder_encode). This uses the default encoder,
+  or a temporary one if it's being used by another thread.
+*/
+VALUE lzw_encode(int argc, VALUE* argv, VALUE self)
+{
+  VALUE c_encoder = rb_const_get(self, rb_intern("LZWEncoder"));
+  LZWGenState *pContext;
+
+  if (NIL_P(default_encoder)) {
+    rb_gc_register_address(&default_encoder);
+    default_encoder = rb_class_new_instance(0, NULL, c_encoder);
+  }
+  TypedData_Get_Struct(default_encoder, LZWGenState, &lzw_encoder_type, pContext);
+  if (pContext->busy)
+    return lzw_encoder_encode(argc, argv, rb_class_new_instance(0, NULL, c_encoder));
+  return lzw_encoder_encode(argc, argv, default_encoder);
+}
@@ -1,11 +1,133 @@
 #include "main.h"
 
+#include <math.h> // round, lround, ceil, floor, pow, sqrt, isnan
+
 void Init_cgifenc() {
   VALUE m_gifenc = rb_const_get(rb_cObject, rb_intern("Gifenc"));
   VALUE c_image = rb_const_get(m_gifenc, rb_intern("Image"));
+  VALUE c_encoder = rb_define_class_under(m_gifenc, "LZWEncoder", rb_cObject);
+  VALUE c_reader = rb_define_class_under(m_gifenc, "Reader", rb_cObject);
+  VALUE c_color_map = rb_define_class_under(m_gifenc, "ColorMap", rb_cObject);
+  VALUE c_dither = rb_define_class_under(m_gifenc, "Dither", rb_cObject);
 
-  rb_define_singleton_method(m_gifenc, "lzw_encode", lzw_encode, 1);
+  rb_define_alloc_func(c_encoder, lzw_encoder_alloc);
+  rb_define_method(c_encoder, "encode", lzw_encoder_encode, -1);
+  rb_define_singleton_method(m_gifenc, "lzw_encode", lzw_encode, -1);
+  rb_define_singleton_method(m_gifenc, "lzw_decode", lzw_decode, -1);
+  rb_define_singleton_method(m_gifenc, "gif_index", gif_index, 1);
+  rb_define_alloc_func(c_reader, gif_reader_alloc);
+  rb_define_method(c_reader, "initialize", gif_reader_initialize, 1);
+  rb_define_method(c_reader, "index", gif_reader_index, 0);
+  rb_define_method(c_reader, "read", gif_reader_read, 2);
+  rb_define_method(c_reader, "decode", gif_reader_decode, 5);
+  rb_define_method(c_reader, "size", gif_reader_size, 0);
+  rb_define_method(c_reader, "close", gif_reader_close, 0);
+  rb_define_method(c_reader, "closed?", gif_reader_closed, 0);
+  rb_define_singleton_method(m_gifenc, "frame_composite", frame_composite, -1);
+  rb_define_singleton_method(m_gifenc, "frame_diff", frame_diff, -1);
+  rb_define_singleton_method(m_gifenc, "rgb_quantize", rgb_quantize, -1);
+  rb_define_singleton_method(m_gifenc, "rgb_map", rgb_map, 2);
+  rb_define_singleton_method(m_gifenc, "rgb_pack", rgb_pack, 1);
+  rb_define_alloc_func(c_color_map, color_map_alloc);
+  rb_define_method(c_color_map, "initialize", color_map_initialize, 1);
+  rb_define_method(c_color_map, "find", color_map_find, 1);
+  rb_define_method(c_color_map, "map", color_map_map, 1);
+  rb_define_singleton_method(m_gifenc, "index_histogram", index_histogram, 2);
+  rb_define_singleton_method(m_gifenc, "blockify", blockify, 1);
+  rb_define_singleton_method(m_gifenc, "deblockify", deblockify, -1);
+  rb_define_singleton_method(m_gifenc, "write_blocks", write_blocks, 2);
+  rb_define_singleton_method(m_gifenc, "points_translate", points_translate, 3);
+  rb_define_singleton_method(m_gifenc, "points_bounds", points_bounds, 1);
+  rb_define_alloc_func(c_dither, dither_alloc);
+  rb_define_method(c_dither, "initialize", dither_initialize, 6);
+  rb_define_method(c_dither, "run", dither_run, 1);
+  rb_define_method(c_dither, "abort", dither_abort, 0);
   rb_define_method(c_image, "copy_raw", copy_raw, -1);
+  rb_define_method(c_image, "line_raw", line_raw, -1);
+  rb_define_method(c_image, "rect_raw", rect_raw, -1);
+  rb_define_method(c_image, "brush_raw", brush_raw, -1);
+  rb_define_method(c_image, "ellipse_raw", ellipse_raw, 8);
+  rb_define_method(c_image, "path_raw", path_raw, -1);
+  rb_define_method(c_image, "dots_raw", dots_raw, 3);
+  rb_define_method(c_image, "fill_raw", fill_raw, -1);
+  rb_define_method(c_image, "get_rect_raw", get_rect_raw, 4);
+  rb_define_method(c_image, "set_rect_raw", set_rect_raw, 5);
+  rb_define_method(c_image, "get_col_raw", get_col_raw, 3);
+  rb_define_method(c_image, "set_col_raw", set_col_raw, 3);
+  rb_define_method(c_image, "get_raw", get_raw, 1);
+  rb_define_method(c_image, "set_raw", set_raw, 2);
+  rb_define_method(c_image, "resize_raw", resize_raw, 3);
+  rb_define_method(c_image, "scale_raw", scale_raw, 2);
+  rb_define_method(c_image, "remap_raw", remap_raw, 1);
+}
+
+/* Pixel buffer of an image being drawn on, with the clipping region and drawn bounds */
+typedef struct {
+  uint8_t *pix;
+  long w, h;
+  long cx0, cy0, cx1, cy1;
+  long dx0, dy0, dx1, dy1;
+} Canvas;
+
+/*
+  Prepare an image for drawing, restricted to a bounding box [X, Y, W, H] (or
+  the whole image, if nil). Like Brush#draw, a pixel (x, y) is within the box
+  if X <= x <= X + W - 1, and same for y.
+*/
+static void canvas_init(Canvas *c, VALUE self, VALUE bbox) {
+  VALUE pixels = rb_funcall(self, rb_intern("writable_pixels"), 0);
+  rb_str_modify(pixels);
+  c->pix = (uint8_t*)RSTRING_PTR(pixels);
+  c->w = FIX2LONG(rb_funcall(self, rb_intern("width"), 0));
+  c->h = FIX2LONG(rb_funcall(self, rb_intern("height"), 0));
+  c->cx0 = 0;
+  c->cy0 = 0;
+  c->cx1 = c->w - 1;
+  c->cy1 = c->h - 1;
+  if (!NIL_P(bbox)) {
+    Check_Type(bbox, T_ARRAY);
+    if (RARRAY_LEN(bbox) != 4)
+      rb_raise(rb_eArgError, "Bounding box must be [x, y, w, h].");
+    double bx = NUM2DBL(RARRAY_AREF(bbox, 0)), by = NUM2DBL(RARRAY_AREF(bbox, 1));
+    double bw = NUM2DBL(RARRAY_AREF(bbox, 2)), bh = NUM2DBL(RARRAY_AREF(bbox, 3));
+    if (ceil(bx) > c->cx0) c->cx0 = ceil(bx);
+    if (ceil(by) > c->cy0) c->cy0 = ceil(by);
+    if (floor(bx + bw - 1) < c->cx1) c->cx1 = floor(bx + bw - 1);
+    if (floor(by + bh - 1) < c->cy1) c->cy1 = floor(by + bh - 1);
+  }
+  c->dx0 = c->w;
+  c->dy0 = c->h;
+  c->dx1 = -1;
+  c->dy1 = -1;
+}
+
+/* Paint the pixels [x0, x1] of a row, clipped to the drawing region */
+static inline void canvas_span(Canvas *c, long x0, long x1, long y, uint8_t color) {
+  if (y < c->cy0 || y > c->cy1) return;
+  if (x0 < c->cx0) x0 = c->cx0;
+  if (x1 > c->cx1) x1 = c->cx1;
+  if (x0 > x1) return;
+  memset(c->pix + y * c->w + x0, color, x1 - x0 + 1);
+  if (x0 < c->dx0) c->dx0 = x0;
+  if (x1 > c->dx1) c->dx1 = x1;
+  if (y < c->dy0) c->dy0 = y;
+  if (y > c->dy1) c->dy1 = y;
+}
+
+/* Bounding box [X, Y, W, H] of the pixels drawn, or nil if none */
+static VALUE canvas_drawn(Canvas *c) {
+  if (c->dx1 < 0) return Qnil;
+  return rb_ary_new_from_args(4,
+    LONG2FIX(c->dx0), LONG2FIX(c->dy0),
+    LONG2FIX(c->dx1 - c->dx0 + 1), LONG2FIX(c->dy1 - c->dy0 + 1)
+  );
+}
+
+/* Color index given either as an integer or as a 1-char binary string */
+static uint8_t color_index(VALUE color) {
+  if (RB_TYPE_P(color, T_STRING))
+    return RSTRING_LEN(color) > 0 ? (uint8_t)RSTRING_PTR(color)[0] : 0;
+  return NUM2INT(color) & 0xFF;
 }
 
 VALUE copy_raw(int argc, VALUE* argv, VALUE self) {
@@ -22,8 +144,11 @@ VALUE copy_raw(int argc, VALUE* argv, VALUE self) {
 
   long self_w = FIX2LONG(rb_funcall(self, rb_intern("width"), 0));
   long src_w  = FIX2LONG(rb_funcall(src,  rb_intern("width"), 0));
-  uint8_t *self_pix = (uint8_t*)RSTRING_PTR(rb_funcall(self, rb_intern("pixels"), 0));
-  uint8_t *src_pix = (uint8_t*)RSTRING_PTR(rb_funcall(src, rb_intern("pixels"), 0));
+  VALUE self_str = rb_funcall(self, rb_intern("writable_pixels"), 0);
+  rb_str_modify(self_str);
+  uint8_t *self_pix = (uint8_t*)RSTRING_PTR(self_str);
+  VALUE src_str = rb_funcall(src, rb_intern("pixels"), 0);
+  uint8_t *src_pix = (uint8_t*)RSTRING_PTR(src_str);
 
   long x, y;
   VALUE px;
@@ -35,5 +160,775 @@ VALUE copy_raw(int argc, VALUE* argv, VALUE self) {
     }
   }
 
+  RB_GC_GUARD(src_str);
   return self;
-}
\ No newline at end of file
+}
+/*
+  Draw the pixels of an image (of size w * h) onto a canvas (of size cw * ch)
+  at the given offset, clipping it to the canvas, and skipping the pixels that
+  have the transparent color, if any.
+*/
+VALUE frame_composite(int argc, VALUE* argv, VALUE self) {
+  VALUE canvas, opt_cw, opt_ch, pixels, opt_x, opt_y, opt_w, opt_h, opt_trans;
+  rb_scan_args(argc, argv, "9", &canvas, &opt_cw, &opt_ch, &pixels, &opt_x, &opt_y, &opt_w, &opt_h, &opt_trans);
+  long
+    cw = NUM2LONG(opt_cw), ch = NUM2LONG(opt_ch),
+    ox = NUM2LONG(opt_x), oy = NUM2LONG(opt_y),
+    w = NUM2LONG(opt_w), h = NUM2LONG(opt_h);
+  bool trans = FIXNUM_P(opt_trans);
+  uint8_t bg = trans ? NUM2CHR(opt_trans) : 0;
+  Check_Type(canvas, T_STRING);
+  Check_Type(pixels, T_STRING);
+  if (RSTRING_LEN(canvas) < cw * ch || RSTRING_LEN(pixels) < w * h)
+    rb_raise(rb_eArgError, "Pixel data doesn't match the dimensions.");
+
+  rb_str_modify(canvas);
+  uint8_t *dst = (uint8_t*)RSTRING_PTR(canvas);
+  const uint8_t *src = (const uint8_t*)RSTRING_PTR(pixels);
+  long x0 = ox < 0 ? -ox : 0, y0 = oy < 0 ? -oy : 0;
+  long x1 = ox + w > cw ? cw - ox : w, y1 = oy + h > ch ? ch - oy : h;
+
+  long x, y;
+  for (y = y0; y < y1; y++) {
+    const uint8_t *row = src + y * w;
+    uint8_t *out = dst + (oy + y) * cw + ox;
+    if (!trans) {
+      if (x1 > x0) memcpy(out + x0, row + x0, x1 - x0);
+      continue;
+    }
+    for (x = x0; x < x1; x++)
+      if (row[x] != bg) out[x] = row[x];
+  }
+
+  return canvas;
+}
+
+/*
+  Compare two consecutive frames (of size w * h), and compute the smallest
+  image that turns the first into the second: the bounding box of the pixels
+  that changed, with the unchanged ones set to a transparent color. The given
+  transparent color is preferred, otherwise the first index of the color table
+  (of the given size) not used by the changed pixels is taken, if any. The
+  comparison can be restricted to a region [x, y, w, h] known to contain all
+  the changes. Returns [x, y, w, h, trans, pixels], or nil if the frames are
+  identical.
+*/
+VALUE frame_diff(int argc, VALUE* argv, VALUE self) {
+  VALUE prev, cur, opt_w, opt_h, opt_trans, opt_colors, opt_region;
+  rb_scan_args(argc, argv, "61", &prev, &cur, &opt_w, &opt_h, &opt_trans, &opt_colors, &opt_region);
+  long w = NUM2LONG(opt_w), h = NUM2LONG(opt_h);
+  int colors = NUM2INT(opt_colors);
+  Check_Type(prev, T_STRING);
+  Check_Type(cur, T_STRING);
+  if (RSTRING_LEN(prev) < w * h || RSTRING_LEN(cur) < w * h)
+    rb_raise(rb_eArgError, "Pixel data doesn't match the dimensions.");
+  const uint8_t *a = (const uint8_t*)RSTRING_PTR(prev);
+  const uint8_t *b = (const uint8_t*)RSTRING_PTR(cur);
+
+  // Region to compare
+  long rx0 = 0, ry0 = 0, rx1 = w, ry1 = h;
+  if (!NIL_P(opt_region)) {
+    Check_Type(opt_region, T_ARRAY);
+    if (RARRAY_LEN(opt_region) != 4)
+      rb_raise(rb_eArgError, "Region must be [x, y, w, h].");
+    rx0 = NUM2LONG(RARRAY_AREF(opt_region, 0));
+    ry0 = NUM2LONG(RARRAY_AREF(opt_region, 1));
+    rx1 = rx0 + NUM2LONG(RARRAY_AREF(opt_region, 2));
+    ry1 = ry0 + NUM2LONG(RARRAY_AREF(opt_region, 3));
+    if (rx0 < 0) rx0 = 0;
+    if (ry0 < 0) ry0 = 0;
+    if (rx1 > w) rx1 = w;
+    if (ry1 > h) ry1 = h;
+  }
+
+  // Bounding box of the changes, and colors used by the changed pixels
+  long x, y, x0 = w, y0 = h, x1 = -1, y1 = -1;
+  bool used[256] = { false };
+  for (y = ry0; y < ry1; y++) {
+    const uint8_t *ra = a + y * w, *rb = b + y * w;
+    if (rx1 <= rx0 || !memcmp(ra + rx0, rb + rx0, rx1 - rx0)) continue;
+    if (y < y0) y0 = y;
+    y1 = y;
+    for (x = rx0; x < rx1; x++) {
+      if (ra[x] == rb[x]) continue;
+      if (x < x0) x0 = x;
+      if (x > x1) x1 = x;
+      used[rb[x]] = true;
+    }
+  }
+  if (x1 < 0) return Qnil;
+
+  // Pick a transparent color that doesn't clash with the changes
+  int trans = -1;
+  if (colors > 256) colors = 256;
+  if (FIXNUM_P(opt_trans) && FIX2INT(opt_trans) >= 0 && FIX2INT(opt_trans) < 256 && !used[FIX2INT(opt_trans)])
+    trans = FIX2INT(opt_trans);
+  for (x = 0; trans < 0 && x < colors; x++)
+    if (!used[x]) trans = x;
+
+  // Crop the new frame, making the unchanged pixels transparent
+  long bw = x1 - x0 + 1, bh = y1 - y0 + 1;
+  VALUE pixels = rb_str_new(NULL, bw * bh);
+  uint8_t *out = (uint8_t*)RSTRING_PTR(pixels);
+  for (y = 0; y < bh; y++) {
+    const uint8_t *ra = a + (y0 + y) * w + x0, *rb = b + (y0 + y) * w + x0;
+    uint8_t *ro = out + y * bw;
+    if (trans < 0) {
+      memcpy(ro, rb, bw);
+      continue;
+    }
+    for (x = 0; x < bw; x++)
+      ro[x] = ra[x] == rb[x] ? trans : rb[x];
+  }
+
+  return rb_ary_new_from_args(6,
+    LONG2FIX(x0), LONG2FIX(y0), LONG2FIX(bw), LONG2FIX(bh),
+    trans < 0 ? Qnil : INT2FIX(trans), pixels
+  );
+}
+
+/*
+  Rasterize a straight line from (x1, y1) to (x2, y2), exactly like the
+  original implementation of Image#line: a square brush of the given weight,
+  shifted according to the anchor, is stamped at each step, as long as the
+  ON/OFF dash pattern is on.
+*/
+static void canvas_line(Canvas *c, double x1, double y1, double x2, double y2,
+  double weight, double anchor, double on, double off, double shift, uint8_t color) {
+  // Brush anchor, normal to the line
+  double dx = x2 - x1, dy = y2 - y1, ax = 0, ay = 0;
+  if (pow(pow(fabs(dx), 2) + pow(fabs(dy), 2), 1.0 / 2) >= 1E-7) {
+    double norm = fabs(dy) > fabs(dx) ? fabs(dy) : fabs(dx);
+    ax = -dy / norm;
+    ay = dx / norm;
+    ax -= ax * (1 - anchor);
+    ay -= ay * (1 - anchor);
+  }
+
+  // Square brush
+  if (weight < 1.0) weight = 1.0;
+  long shift_x = round((1 - ax) * (weight - 1) / 2);
+  long shift_y = round((1 - ay) * (weight - 1) / 2);
+  long size = round(weight);
+
+  // Walk the line
+  long steps = (long)ceil(fabs(dy) > fabs(dx) ? fabs(dy) : fabs(dx)) + 1;
+  double step_x = dx / (steps - 1 > 1 ? steps - 1 : 1);
+  double step_y = dy / (steps - 1 > 1 ? steps - 1 : 1);
+  double px = x1, py = y1, period = on + off;
+  long s, j;
+  for (s = 0; s < steps; s++) {
+    double phase = fmod(s - shift, period);
+    if (phase < 0) phase += period;
+    if (phase < on) {
+      long bx = (long)round(px) - shift_x, by = (long)round(py) - shift_y;
+      for (j = 0; j < size; j++)
+        canvas_span(c, bx, bx + size - 1, by + j, color);
+    }
+    px += step_x;
+    py += step_y;
+  }
+}
+
+/* Draw a single line (see canvas_line). Returns the bbox of the drawn pixels. */
+VALUE line_raw(int argc, VALUE* argv, VALUE self) {
+  rb_check_arity(argc, 10, 11); // Too many for rb_scan_args
+  double on = NUM2DBL(argv[7]), off = NUM2DBL(argv[8]);
+  VALUE bbox = argc > 10 ? argv[10] : Qnil;
+  if (on + off == 0)
+    rb_raise(rb_eZeroDivError, "Line pattern cannot be empty.");
+  Canvas c;
+  canvas_init(&c, self, bbox);
+  canvas_line(&c,
+    NUM2DBL(argv[0]), NUM2DBL(argv[1]), NUM2DBL(argv[2]), NUM2DBL(argv[3]),
+    NUM2DBL(argv[5]), NUM2DBL(argv[6]), on, off, NUM2DBL(argv[9]), color_index(argv[4])
+  );
+  return canvas_drawn(&c);
+}
+
+/* Packed native doubles, as [x0, y0, x1, y1, ...], and the amount of points */
+static const double *packed_points(VALUE coords, long *count) {
+  Check_Type(coords, T_STRING);
+  if (RSTRING_LEN(coords) % (2 * sizeof(double)))
+    rb_raise(rb_eArgError, "Packed points must be pairs of doubles.");
+  *count = RSTRING_LEN(coords) / (2 * sizeof(double));
+  return (const double*)RSTRING_PTR(coords);
+}
+
+/*
+  Draw a polygonal chain through a list of packed points (see packed_points),
+  joining each pair of consecutive points with a line (see canvas_line). Points
+  with NaN coordinates leave a gap. Returns the bbox of the drawn pixels.
+*/
+VALUE path_raw(int argc, VALUE* argv, VALUE self) {
+  VALUE coords, opt_color, opt_weight, opt_anchor, opt_on, opt_off, opt_shift, bbox;
+  rb_scan_args(argc, argv, "71", &coords, &opt_color, &opt_weight, &opt_anchor, &opt_on, &opt_off, &opt_shift, &bbox);
+  double
+    weight = NUM2DBL(opt_weight), anchor = NUM2DBL(opt_anchor),
+    on = NUM2DBL(opt_on), off = NUM2DBL(opt_off), shift = NUM2DBL(opt_shift);
+  uint8_t color = color_index(opt_color);
+  if (on + off == 0)
+    rb_raise(rb_eZeroDivError, "Line pattern cannot be empty.");
+  long i, n;
+  const double *p = packed_points(coords, &n);
+  Canvas c;
+  canvas_init(&c, self, bbox);
+
+  for (i = 0; i + 1 < n; i++) {
+    const double *a = p + 2 * i, *b = a + 2;
+    if (isnan(a[0]) || isnan(a[1]) || isnan(b[0]) || isnan(b[1])) continue;
+    canvas_line(&c, a[0], a[1], b[0], b[1], weight, anchor, on, off, shift, color);
+  }
+
+  return canvas_drawn(&c);
+}
+
+/*
+  Translate a list of packed points (see packed_points) by (dx, dy), returning
+  the new packed list.
+*/
+VALUE points_translate(VALUE self, VALUE coords, VALUE opt_dx, VALUE opt_dy) {
+  long i, n;
+  const double *in = packed_points(coords, &n);
+  double d[2] = { NUM2DBL(opt_dx), NUM2DBL(opt_dy) };
+  VALUE str = rb_str_new(NULL, 2 * n * sizeof(double));
+  double *out = (double*)RSTRING_PTR(str);
+  for (i = 0; i < 2 * n; i++)
+    out[i] = in[i] + d[i & 1];
+  return str;
+}
+
+/*
+  Smallest box containing a list of packed points (see packed_points), as
+  [min_x, min_y, max_x, max_y], or nil if there are no points. Points with
+  NaN coordinates are ignored.
+*/
+VALUE points_bounds(VALUE self, VALUE coords) {
+  long i, n;
+  const double *p = packed_points(coords, &n);
+  double x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+  bool found = false;
+  for (i = 0; i < n; i++) {
+    double x = p[2 * i], y = p[2 * i + 1];
+    if (isnan(x) || isnan(y)) continue;
+    if (x < x0) x0 = x;
+    if (x > x1) x1 = x;
+    if (y < y0) y0 = y;
+    if (y > y1) y1 = y;
+    found = true;
+  }
+  if (!found) return Qnil;
+  return rb_ary_new_from_args(4, DBL2NUM(x0), DBL2NUM(y0), DBL2NUM(x1), DBL2NUM(y1));
+}
+
+/* Fill the rectangle with corners (x0, y0) and (x1, y1), both inclusive */
+VALUE rect_raw(int argc, VALUE* argv, VALUE self) {
+  VALUE opt_x0, opt_y0, opt_x1, opt_y1, opt_color, bbox;
+  rb_scan_args(argc, argv, "51", &opt_x0, &opt_y0, &opt_x1, &opt_y1, &opt_color, &bbox);
+  long
+    x0 = NUM2LONG(opt_x0), y0 = NUM2LONG(opt_y0),
+    x1 = NUM2LONG(opt_x1), y1 = NUM2LONG(opt_y1);
+  uint8_t color = color_index(opt_color);
+  Canvas c;
+  canvas_init(&c, self, bbox);
+
+  long y;
+  for (y = y0; y <= y1; y++)
+    canvas_span(&c, x0, x1, y, color);
+
+  return canvas_drawn(&c);
+}
+
+/*
+  Stamp a brush, given as a list of [dx, dy] pixel offsets, at (x, y). Returns
+  the bounding box of the drawn pixels.
+*/
+VALUE brush_raw(int argc, VALUE* argv, VALUE self) {
+  VALUE opt_x, opt_y, offsets, opt_color, bbox;
+  rb_scan_args(argc, argv, "41", &opt_x, &opt_y, &offsets, &opt_color, &bbox);
+  long x = NUM2LONG(opt_x), y = NUM2LONG(opt_y);
+  uint8_t color = color_index(opt_color);
+  Check_Type(offsets, T_ARRAY);
+  Canvas c;
+  canvas_init(&c, self, bbox);
+
+  long i, len = RARRAY_LEN(offsets);
+  for (i = 0; i < len; i++) {
+    VALUE offset = RARRAY_AREF(offsets, i);
+    Check_Type(offset, T_ARRAY);
+    if (RARRAY_LEN(offset) < 2)
+      rb_raise(rb_eArgError, "Brush pixels must be [dx, dy] pairs.");
+    long px = x + NUM2LONG(RARRAY_AREF(offset, 0));
+    canvas_span(&c, px, px, y + NUM2LONG(RARRAY_AREF(offset, 1)), color);
+  }
+
+  return canvas_drawn(&c);
+}
+
+/* Half width of the row `y` of an ellipse with semi-axes a and b, f = (a/b)^2 */
+static inline long ellipse_span(double a, double f, long y) {
+  if (y == 0) return lround(a);
+  double d = a * a - f * (y - 0.5) * (y - 0.5);
+  return lround(d > 0 ? sqrt(d) : 0);
+}
+
+/* Fill an ellipse centered at (cx, cy) with semi-axes a and b */
+static void canvas_ellipse(Canvas *c, long cx, long cy, double a, double b, uint8_t color) {
+  double f = pow(a / b, 2);
+  long y, r;
+  for (y = lround(b); y >= 0; y--) {
+    r = ellipse_span(a, f, y);
+    canvas_span(c, cx - r, cx + r, cy - y, color);
+    if (y > 0) canvas_span(c, cx - r, cx + r, cy + y, color);
+  }
+}
+
+/*
+  Draw an ellipse centered at (cx, cy) with semi-axes a and b, painting each
+  row with whole spans. The stroke lies inside the ellipse: with the smooth
+  style it's the region between it and the ellipse `weight` pixels smaller,
+  whereas with the grid style it's made of `weight` layers of the outline.
+  Returns the bbox of the drawn pixels.
+*/
+VALUE ellipse_raw(VALUE self, VALUE opt_cx, VALUE opt_cy, VALUE opt_a, VALUE opt_b, VALUE stroke, VALUE fill, VALUE opt_weight, VALUE grid) {
+  long cx = NUM2LONG(opt_cx), cy = NUM2LONG(opt_cy), weight = NUM2LONG(opt_weight);
+  double a = NUM2DBL(opt_a), b = NUM2DBL(opt_b), f = pow(a / b, 2);
+  long y, w, r, top = lround(b);
+  Canvas c;
+  canvas_init(&c, self, Qnil);
+
+  // Fill
+  if (!NIL_P(fill))
+    canvas_ellipse(&c, cx, cy, a, b, color_index(fill));
+
+  // Stroke
+  if (!NIL_P(stroke)) {
+    uint8_t color = color_index(stroke);
+    if (RTEST(grid)) {
+      long prev = 0;
+      for (y = top; y >= 0; y--) {
+        r = ellipse_span(a, f, y);
+        long border = weight + r - prev < 1 + r ? weight + r - prev : 1 + r;
+        long layers = weight < y + 1 ? weight : y + 1;
+        for (w = 0; w < layers; w++) {
+          canvas_span(&c, cx - r, cx - r + border - 1, cy - y + w, color);
+          canvas_span(&c, cx + r - border + 1, cx + r, cy - y + w, color);
+          if (y == 0) continue;
+          canvas_span(&c, cx - r, cx - r + border - 1, cy + y - w, color);
+          canvas_span(&c, cx + r - border + 1, cx + r, cy + y - w, color);
+        }
+        prev = r;
+      }
+    } else {
+      double a2 = a - weight > 0 ? a - weight : 0, b2 = b - weight > 0 ? b - weight : 0;
+      double f2 = pow(a2 / b2, 2);
+      for (y = top; y >= 0; y--) {
+        r = ellipse_span(a, f, y);
+        long r2 = y == 0 ? lround(a2) : a2 * a2 >= f2 * (y - 0.5) * (y - 0.5) ? ellipse_span(a2, f2, y) : -1;
+        long border = r - r2;
+        canvas_span(&c, cx - r, cx - r + border - 1, cy - y, color);
+        canvas_span(&c, cx + r - border + 1, cx + r, cy - y, color);
+        if (y == 0) continue;
+        canvas_span(&c, cx - r, cx - r + border - 1, cy + y, color);
+        canvas_span(&c, cx + r - border + 1, cx + r, cy + y, color);
+      }
+    }
+  }
+
+  return canvas_drawn(&c);
+}
+
+/*
+  Draw a filled circle of the given radius at each of a list of packed points
+  (see packed_points), with their centers rounded to the nearest pixel. Points
+  with NaN coordinates are skipped. Returns the bbox of the drawn pixels.
+*/
+VALUE dots_raw(VALUE self, VALUE coords, VALUE opt_color, VALUE opt_r) {
+  long i, n;
+  const double *p = packed_points(coords, &n);
+  double r = NUM2DBL(opt_r);
+  uint8_t color = color_index(opt_color);
+  Canvas c;
+  canvas_init(&c, self, Qnil);
+
+  for (i = 0; i < n; i++) {
+    double x = p[2 * i], y = p[2 * i + 1];
+    if (isnan(x) || isnan(y)) continue;
+    canvas_ellipse(&c, lround(x), lround(y), r, r, color);
+  }
+
+  return canvas_drawn(&c);
+}
+
+/*
+  Scanline flood fill starting at (x, y), replacing the contiguous region of
+  the seed's color by the new one. Seeds are kept on an explicit heap stack
+  (one per run of matching pixels in the neighbouring rows), so the depth
+  doesn't depend on the size of the region. With 8-connectivity, diagonal
+  neighbours also count as contiguous. Returns the bbox of the filled area.
+*/
+VALUE fill_raw(int argc, VALUE* argv, VALUE self) {
+  VALUE opt_x, opt_y, opt_color, opt_conn, bbox;
+  rb_scan_args(argc, argv, "32", &opt_x, &opt_y, &opt_color, &opt_conn, &bbox);
+  long x = NUM2LONG(opt_x), y = NUM2LONG(opt_y);
+  uint8_t color = color_index(opt_color);
+  long diag = !NIL_P(opt_conn) && NUM2INT(opt_conn) == 8 ? 1 : 0;
+  Canvas c;
+  canvas_init(&c, self, bbox);
+  if (x < c.cx0 || x > c.cx1 || y < c.cy0 || y > c.cy1) return Qnil;
+  uint8_t old = c.pix[y * c.w + x];
+  if (old == color) return Qnil;
+
+  long cap = 64, top = 0;
+  long *stack = ALLOC_N(long, 2 * cap);
+  stack[top++] = x;
+  stack[top++] = y;
+
+  while (top > 0) {
+    y = stack[--top];
+    x = stack[--top];
+    uint8_t *row = c.pix + y * c.w;
+    if (row[x] != old) continue;
+
+    // Extend the seed to the whole span and paint it
+    long x0 = x, x1 = x;
+    while (x0 > c.cx0 && row[x0 - 1] == old) x0--;
+    while (x1 < c.cx1 && row[x1 + 1] == old) x1++;
+    canvas_span(&c, x0, x1, y, color);
+
+    // Push one seed per run of the old color in the rows above and below
+    long lo = x0 - diag < c.cx0 ? c.cx0 : x0 - diag;
+    long hi = x1 + diag > c.cx1 ? c.cx1 : x1 + diag;
+    long ny, i;
+    for (ny = y - 1; ny <= y + 1; ny += 2) {
+      if (ny < c.cy0 || ny > c.cy1) continue;
+      uint8_t *nrow = c.pix + ny * c.w;
+      for (i = lo; i <= hi; i++) {
+        if (nrow[i] != old || (i > lo && nrow[i - 1] == old)) continue;
+        if (top + 2 > 2 * cap) {
+          cap *= 2;
+          REALLOC_N(stack, long, 2 * cap);
+        }
+        stack[top++] = i;
+        stack[top++] = ny;
+      }
+    }
+  }
+
+  xfree(stack);
+  return canvas_drawn(&c);
+}
+
+/* Pixel buffer of an image for writing, after checking a region is inside */
+static uint8_t *region_pixels(VALUE self, long x, long y, long w, long h, long *width, bool write) {
+  VALUE pixels = rb_funcall(self, rb_intern(write ? "writable_pixels" : "pixels"), 0);
+  long height = FIX2LONG(rb_funcall(self, rb_intern("height"), 0));
+  *width = FIX2LONG(rb_funcall(self, rb_intern("width"), 0));
+  if (x < 0 || y < 0 || w < 0 || h < 0 || x + w > *width || y + h > height)
+    rb_raise(rb_eArgError, "Region out of bounds.");
+  if (write) rb_str_modify(pixels);
+  return (uint8_t*)RSTRING_PTR(pixels);
+}
+
+/*
+  Fetch the pixels of the rectangle [X, Y, W, H] as a packed binary string. If
+  the rectangle spans whole rows, it's contiguous, and the result shares the
+  buffer of the image until either of them is modified.
+*/
+VALUE get_rect_raw(VALUE self, VALUE opt_x, VALUE opt_y, VALUE opt_w, VALUE opt_h) {
+  long
+    x = NUM2LONG(opt_x), y = NUM2LONG(opt_y),
+    w = NUM2LONG(opt_w), h = NUM2LONG(opt_h), width;
+  uint8_t *pix = region_pixels(self, x, y, w, h, &width, false);
+  if (w == width)
+    return rb_str_substr(rb_funcall(self, rb_intern("pixels"), 0), y * width, w * h);
+
+  VALUE str = rb_str_new(NULL, w * h);
+  uint8_t *out = (uint8_t*)RSTRING_PTR(str);
+  long r;
+  for (r = 0; r < h; r++)
+    memcpy(out + r * w, pix + (y + r) * width + x, w);
+  return str;
+}
+
+/* Overwrite the rectangle [X, Y, W, H] with a packed binary string */
+VALUE set_rect_raw(VALUE self, VALUE opt_x, VALUE opt_y, VALUE opt_w, VALUE opt_h, VALUE data) {
+  long
+    x = NUM2LONG(opt_x), y = NUM2LONG(opt_y),
+    w = NUM2LONG(opt_w), h = NUM2LONG(opt_h), width;
+  StringValue(data);
+  if (RSTRING_LEN(data) < w * h)
+    rb_raise(rb_eArgError, "Not enough pixel data for the region.");
+  uint8_t *pix = region_pixels(self, x, y, w, h, &width, true);
+  const uint8_t *in = (const uint8_t*)RSTRING_PTR(data);
+  if (w == width) {
+    memcpy(pix + y * width, in, w * h);
+    return self;
+  }
+
+  long r;
+  for (r = 0; r < h; r++)
+    memcpy(pix + (y + r) * width + x, in + r * w, w);
+  return self;
+}
+
+/* Fetch H pixels of column X, starting at row Y, as a packed binary string */
+VALUE get_col_raw(VALUE self, VALUE opt_x, VALUE opt_y, VALUE opt_h) {
+  long x = NUM2LONG(opt_x), y = NUM2LONG(opt_y), h = NUM2LONG(opt_h), width;
+  uint8_t *pix = region_pixels(self, x, y, 1, h, &width, false) + y * width + x;
+  VALUE str = rb_str_new(NULL, h);
+  uint8_t *out = (uint8_t*)RSTRING_PTR(str);
+  long r;
+  for (r = 0; r < h; r++, pix += width)
+    out[r] = *pix;
+  return str;
+}
+
+/* Write a packed binary string down column X, starting at row Y */
+VALUE set_col_raw(VALUE self, VALUE opt_x, VALUE opt_y, VALUE data) {
+  long x = NUM2LONG(opt_x), y = NUM2LONG(opt_y), width;
+  StringValue(data);
+  long h = RSTRING_LEN(data);
+  uint8_t *pix = region_pixels(self, x, y, 1, h, &width, true) + y * width + x;
+  const uint8_t *in = (const uint8_t*)RSTRING_PTR(data);
+  long r;
+  for (r = 0; r < h; r++, pix += width)
+    *pix = in[r];
+  return self;
+}
+
+/* Offset in the pixel buffer of an [X, Y] point, after checking it's inside */
+static long point_offset(VALUE p, long width, long height) {
+  if (!RB_TYPE_P(p, T_ARRAY) || RARRAY_LEN(p) != 2)
+    rb_raise(rb_eArgError, "Points must be [x, y] pairs.");
+  long x = NUM2LONG(RARRAY_AREF(p, 0)), y = NUM2LONG(RARRAY_AREF(p, 1));
+  if (x < 0 || y < 0 || x >= width || y >= height)
+    rb_raise(rb_eArgError, "Point out of bounds.");
+  return y * width + x;
+}
+
+/* Colors of a list of [X, Y] points, which must be within the image */
+VALUE get_raw(VALUE self, VALUE points) {
+  Check_Type(points, T_ARRAY);
+  long i, len = RARRAY_LEN(points), width;
+  long height = FIX2LONG(rb_funcall(self, rb_intern("height"), 0));
+  uint8_t *pix = region_pixels(self, 0, 0, 0, 0, &width, false);
+  VALUE colors = rb_ary_new_capa(len);
+  for (i = 0; i < len; i++) {
+    long offset = point_offset(RARRAY_AREF(points, i), width, height);
+    rb_ary_push(colors, INT2FIX(pix[offset]));
+  }
+  return colors;
+}
+
+/*
+  Paint a list of [X, Y] points, which must be within the image, either with a
+  single color or with a list of colors, one per point.
+*/
+VALUE set_raw(VALUE self, VALUE points, VALUE colors) {
+  Check_Type(points, T_ARRAY);
+  bool single = !RB_TYPE_P(colors, T_ARRAY);
+  uint8_t color = single ? color_index(colors) : 0;
+  long i, len = RARRAY_LEN(points), width;
+  long height = FIX2LONG(rb_funcall(self, rb_intern("height"), 0));
+  if (!single && RARRAY_LEN(colors) < len)
+    rb_raise(rb_eArgError, "Not enough colors for the points.");
+  uint8_t *pix = region_pixels(self, 0, 0, 0, 0, &width, true);
+  for (i = 0; i < len; i++) {
+    long offset = point_offset(RARRAY_AREF(points, i), width, height);
+    pix[offset] = single ? color : color_index(RARRAY_AREF(colors, i));
+  }
+  return self;
+}
+
+/*
+  Crop or pad the pixels of an image to new dimensions, in place. Rows keep
+  their position at the top left, and the new area is filled with the given
+  color. When the rows grow they're moved from the bottom up, and otherwise
+  from the top down, so that no row is overwritten before being moved.
+*/
+VALUE resize_raw(VALUE self, VALUE opt_w, VALUE opt_h, VALUE opt_color) {
+  long
+    nw = NUM2LONG(opt_w), nh = NUM2LONG(opt_h),
+    ow = FIX2LONG(rb_funcall(self, rb_intern("width"), 0)),
+    oh = FIX2LONG(rb_funcall(self, rb_intern("height"), 0));
+  if (nw <= 0 || nh <= 0)
+    rb_raise(rb_eArgError, "Image dimensions must be positive.");
+  uint8_t color = color_index(opt_color);
+  VALUE pixels = rb_funcall(self, rb_intern("writable_pixels"), 0);
+  rb_str_modify(pixels);
+  if (nw * nh > ow * oh) rb_str_resize(pixels, nw * nh);
+  uint8_t *pix = (uint8_t*)RSTRING_PTR(pixels);
+
+  long r, rows = nh < oh ? nh : oh, len = nw < ow ? nw : ow;
+  if (nw <= ow) {
+    for (r = 1; r < rows; r++)
+      memmove(pix + r * nw, pix + r * ow, len);
+  } else {
+    for (r = rows - 1; r >= 0; r--) {
+      memmove(pix + r * nw, pix + r * ow, len);
+      memset(pix + r * nw + ow, color, nw - ow);
+    }
+  }
+  if (nh > oh) memset(pix + oh * nw, color, (nh - oh) * nw);
+
+  rb_str_resize(pixels, nw * nh);
+  return pixels;
+}
+
+/*
+  Scale the pixels of an image to new dimensions using nearest neighbour
+  sampling, returning them as a new string. Each destination pixel takes the
+  source pixel under its center. Consecutive rows sampling the same source row
+  are copied whole, and integer upscaling factors fill runs with memset.
+*/
+VALUE scale_raw(VALUE self, VALUE opt_w, VALUE opt_h) {
+  long
+    nw = NUM2LONG(opt_w), nh = NUM2LONG(opt_h),
+    ow = FIX2LONG(rb_funcall(self, rb_intern("width"), 0)),
+    oh = FIX2LONG(rb_funcall(self, rb_intern("height"), 0));
+  if (nw <= 0 || nh <= 0 || ow <= 0 || oh <= 0)
+    rb_raise(rb_eArgError, "Dimensions must be positive.");
+  VALUE src_str = rb_funcall(self, rb_intern("pixels"), 0);
+  const uint8_t *pix = (const uint8_t*)RSTRING_PTR(src_str);
+  VALUE str = rb_str_new(NULL, nw * nh);
+  uint8_t *out = (uint8_t*)RSTRING_PTR(str);
+
+  long x, y, sy, last = -1, k = nw % ow == 0 ? nw / ow : 0;
+  long *xmap = k ? NULL : ALLOC_N(long, nw);
+  if (!k)
+    for (x = 0; x < nw; x++)
+      xmap[x] = (2 * x + 1) * ow / (2 * nw);
+
+  for (y = 0; y < nh; y++) {
+    uint8_t *dst = out + y * nw;
+    sy = (2 * y + 1) * oh / (2 * nh);
+    if (sy == last) {
+      memcpy(dst, dst - nw, nw);
+      continue;
+    }
+    const uint8_t *src = pix + sy * ow;
+    if (k)
+      for (x = 0; x < ow; x++)
+        memset(dst + x * k, src[x], k);
+    else
+      for (x = 0; x < nw; x++)
+        dst[x] = src[xmap[x]];
+    last = sy;
+  }
+
+  if (xmap) xfree(xmap);
+  RB_GC_GUARD(src_str);
+  return str;
+}
+
+/* Translate every color index of an image through a 256-byte lookup table */
+VALUE remap_raw(VALUE self, VALUE lut) {
+  StringValue(lut);
+  if (RSTRING_LEN(lut) < 256)
+    rb_raise(rb_eArgError, "The lookup table must have 256 entries.");
+  VALUE pixels = rb_funcall(self, rb_intern("writable_pixels"), 0);
+  rb_str_modify(pixels);
+  uint8_t *pix = (uint8_t*)RSTRING_PTR(pixels);
+  const uint8_t *map = (const uint8_t*)RSTRING_PTR(lut);
+  long i, len = RSTRING_LEN(pixels);
+  for (i = 0; i < len; i++)
+    pix[i] = map[pix[i]];
+  return self;
+}
+
+/* Size of a chunk of data once laid out in sub-blocks, including the terminator */
+static inline long blockified_len(long len) {
+  return len + (len + 254) / 255 + 1;
+}
+
+/* Lay data out in sub-blocks of at most 255 bytes, returning the bytes written */
+static long blockify_into(uint8_t *out, const uint8_t *in, long len) {
+  long off = 0, pos = 0;
+  while (off < len) {
+    long n = len - off < 255 ? len - off : 255;
+    out[pos++] = n;
+    memcpy(out + pos, in + off, n);
+    pos += n;
+    off += n;
+  }
+  return pos;
+}
+
+/*
+  Divide data into sub-blocks as used by GIF (see Util.blockify). The output
+  is allocated at its exact final size and filled in a single pass.
+*/
+VALUE blockify(VALUE self, VALUE data) {
+  StringValue(data);
+  long len = RSTRING_LEN(data);
+  VALUE out = rb_str_new(NULL, blockified_len(len));
+  uint8_t *pOut = (uint8_t*)RSTRING_PTR(out);
+  long pos = blockify_into(pOut, (const uint8_t*)RSTRING_PTR(data), len);
+  pOut[pos] = 0;
+  return out;
+}
+
+/*
+  Recover the data inside a sequence of sub-blocks starting at the given
+  offset, up to the terminator (see Util.deblockify). Returns an empty string
+  if the sequence is truncated.
+*/
+VALUE deblockify(int argc, VALUE* argv, VALUE self) {
+  VALUE data, opt_offset;
+  rb_scan_args(argc, argv, "11", &data, &opt_offset);
+  StringValue(data);
+  const uint8_t *in = (const uint8_t*)RSTRING_PTR(data);
+  long len = RSTRING_LEN(data), start = NIL_P(opt_offset) ? 0 : NUM2LONG(opt_offset);
+  if (start < 0) start = 0;
+
+  // Measure first, so that the output is allocated once
+  long pos = start, total = 0;
+  while (pos < len && in[pos]) {
+    total += in[pos];
+    pos += in[pos] + 1;
+  }
+  if (pos >= len) return rb_str_new(NULL, 0);
+
+  VALUE out = rb_str_new(NULL, total);
+  uint8_t *pOut = (uint8_t*)RSTRING_PTR(out);
+  for (pos = start; in[pos]; pos += in[pos] + 1) {
+    memcpy(pOut, in + pos + 1, in[pos]);
+    pOut += in[pos];
+  }
+  return out;
+}
+
+/* Amount of blockified data to accumulate before writing it to the stream */
+#define BLOCK_FLUSH_SIZE (256 * 256)
+
+/*
+  Write data to a stream laid out in sub-blocks, including the terminator,
+  without building the whole blockified string first. The sub-blocks are
+  batched in a fixed-size buffer which is written whenever it fills up, using
+  IO#write directly for real IO objects, and << otherwise (e.g. for strings).
+  Returns the amount of bytes written.
+*/
+VALUE write_blocks(VALUE self, VALUE stream, VALUE data) {
+  StringValue(data);
+  data = rb_str_new_frozen(data);
+  const uint8_t *in = (const uint8_t*)RSTRING_PTR(data);
+  long len = RSTRING_LEN(data), off = 0, total = blockified_len(len);
+  bool io = RB_TYPE_P(stream, T_FILE);
+  VALUE buf = rb_str_buf_new(BLOCK_FLUSH_SIZE);
+
+  do {
+    long chunk = len - off < BLOCK_FLUSH_SIZE / 256 * 255 ? len - off : BLOCK_FLUSH_SIZE / 256 * 255;
+    rb_str_resize(buf, blockified_len(chunk));
+    uint8_t *pBuf = (uint8_t*)RSTRING_PTR(buf);
+    long pos = blockify_into(pBuf, in + off, chunk);
+    off += chunk;
+    if (off >= len) pBuf[pos++] = 0; // Terminator goes after the last chunk
+    rb_str_set_len(buf, pos);
+    if (io) rb_io_write(stream, buf);
+    else rb_funcall(stream, rb_intern("<<"), 1, rb_str_dup(buf));
+  } while (off < len);
+
+  RB_GC_GUARD(data);
+  return LONG2NUM(total);
+}
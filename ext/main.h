@@ -6,11 +6,62 @@
 #include <stdlib.h>  // malloc, free
 #include <string.h>  // memset, memcpy
 #include <stdbool.h> // true, false
+#include <time.h>    // clock_gettime
 
 #include "ruby.h"
+#include "ruby/thread.h" // rb_thread_call_without_gvl
+#include "ruby/atomic.h" // RUBY_ATOMIC_LOAD, RUBY_ATOMIC_SET
 
 void Init_cgifenc();
-VALUE lzw_encode(VALUE self, VALUE data);
+void interlace_rows(uint32_t *pRows, uint32_t height);
+VALUE lzw_encoder_alloc(VALUE klass);
+VALUE lzw_encoder_encode(int argc, VALUE* argv, VALUE self);
+VALUE lzw_encode(int argc, VALUE* argv, VALUE self);
+VALUE lzw_decode(int argc, VALUE* argv, VALUE self);
+VALUE gif_index(VALUE self, VALUE data);
+VALUE gif_reader_alloc(VALUE klass);
+VALUE gif_reader_initialize(VALUE self, VALUE filename);
+VALUE gif_reader_index(VALUE self);
+VALUE gif_reader_read(VALUE self, VALUE offset, VALUE len);
+VALUE gif_reader_decode(VALUE self, VALUE offset, VALUE len, VALUE opt_w, VALUE opt_h, VALUE interlace);
+VALUE gif_reader_size(VALUE self);
+VALUE gif_reader_close(VALUE self);
+VALUE gif_reader_closed(VALUE self);
 VALUE copy_raw(int argc, VALUE* argv, VALUE self);
+VALUE line_raw(int argc, VALUE* argv, VALUE self);
+VALUE rect_raw(int argc, VALUE* argv, VALUE self);
+VALUE brush_raw(int argc, VALUE* argv, VALUE self);
+VALUE path_raw(int argc, VALUE* argv, VALUE self);
+VALUE dots_raw(VALUE self, VALUE coords, VALUE opt_color, VALUE opt_r);
+VALUE points_translate(VALUE self, VALUE coords, VALUE opt_dx, VALUE opt_dy);
+VALUE points_bounds(VALUE self, VALUE coords);
+VALUE ellipse_raw(VALUE self, VALUE opt_cx, VALUE opt_cy, VALUE opt_a, VALUE opt_b, VALUE stroke, VALUE fill, VALUE opt_weight, VALUE grid);
+VALUE fill_raw(int argc, VALUE* argv, VALUE self);
+VALUE get_rect_raw(VALUE self, VALUE opt_x, VALUE opt_y, VALUE opt_w, VALUE opt_h);
+VALUE set_rect_raw(VALUE self, VALUE opt_x, VALUE opt_y, VALUE opt_w, VALUE opt_h, VALUE data);
+VALUE get_col_raw(VALUE self, VALUE opt_x, VALUE opt_y, VALUE opt_h);
+VALUE set_col_raw(VALUE self, VALUE opt_x, VALUE opt_y, VALUE data);
+VALUE get_raw(VALUE self, VALUE points);
+VALUE set_raw(VALUE self, VALUE points, VALUE colors);
+VALUE resize_raw(VALUE self, VALUE opt_w, VALUE opt_h, VALUE opt_color);
+VALUE scale_raw(VALUE self, VALUE opt_w, VALUE opt_h);
+VALUE rgb_quantize(int argc, VALUE* argv, VALUE self);
+VALUE rgb_map(VALUE self, VALUE rgb, VALUE colors);
+VALUE rgb_pack(VALUE self, VALUE colors);
+VALUE color_map_alloc(VALUE klass);
+VALUE color_map_initialize(VALUE self, VALUE colors);
+VALUE color_map_find(VALUE self, VALUE color);
+VALUE color_map_map(VALUE self, VALUE rgb);
+VALUE index_histogram(VALUE self, VALUE pixels, VALUE opt_stride);
+VALUE dither_alloc(VALUE klass);
+VALUE dither_initialize(VALUE self, VALUE rgb, VALUE opt_w, VALUE colors, VALUE pixels, VALUE method, VALUE opt_workers);
+VALUE dither_run(VALUE self, VALUE opt_worker);
+VALUE dither_abort(VALUE self);
+VALUE remap_raw(VALUE self, VALUE lut);
+VALUE blockify(VALUE self, VALUE data);
+VALUE deblockify(int argc, VALUE* argv, VALUE self);
+VALUE write_blocks(VALUE self, VALUE stream, VALUE data);
+VALUE frame_composite(int argc, VALUE* argv, VALUE self);
+VALUE frame_diff(int argc, VALUE* argv, VALUE self);
 
 #endif
\ No newline at end of file
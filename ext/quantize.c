@@ -0,0 +1,858 @@
+#include "main.h"
+
+#include <math.h> // cbrt
+#ifdef HAVE_SCHED_H
+#include <sched.h> // sched_yield
+#endif
+
+#define HIST_BITS 5
+#define HIST_LEN (1uL << (3 * HIST_BITS))
+#define CUBE_BITS 6
+#define CUBE_LEN (1uL << (3 * CUBE_BITS))
+#define HASH_LEN 1024
+#define HASH_EMPTY 0xFFFFFFFFu
+#define LUT_EMPTY 0xFFFF
+
+/* Bin of the color histogram, with the exact component sums to average them */
+typedef struct
+{
+  uint64_t count;
+  uint64_t r, g, b;
+} HistBin;
+
+/* Box of the median cut: a range of the list of bins, and its extent */
+typedef struct
+{
+  uint32_t start;
+  uint32_t len;
+  uint64_t count;
+  uint8_t min[3];
+  uint8_t max[3];
+} CutBox;
+
+/* Small open-addressing hash set of 24-bit colors, with an index per color */
+typedef struct
+{
+  uint32_t key[HASH_LEN];
+  uint16_t val[HASH_LEN];
+} ColorHash;
+
+static inline uint32_t rgbAt(const uint8_t *pRGB, size_t i)
+{
+  return (uint32_t)pRGB[3 * i] << 16 | (uint32_t)pRGB[3 * i + 1] << 8 | pRGB[3 * i + 2];
+}
+
+static inline uint32_t hashSlot(const ColorHash *pHash, uint32_t color)
+{
+  uint32_t slot = (color * 2654435761u) >> 22;
+  while (pHash->key[slot] != HASH_EMPTY && pHash->key[slot] != color)
+    slot = (slot + 1) & (HASH_LEN - 1);
+  return slot;
+}
+
+/*
+  Collect the distinct colors of the pixels, if there are at most `max` of them,
+  in order of appearance. Returns the amount, or -1 if there are more.
+*/
+static int exactColors(const uint8_t *pRGB, size_t n, int max, uint32_t *pOut)
+{
+  ColorHash *pHash = ALLOC(ColorHash);
+  memset(pHash->key, 0xFF, sizeof(pHash->key));
+  int count = 0;
+  size_t i;
+  for (i = 0; i < n; i++)
+  {
+    uint32_t color = rgbAt(pRGB, i);
+    uint32_t slot = hashSlot(pHash, color);
+    if (pHash->key[slot] != HASH_EMPTY)
+      continue;
+    if (count == max)
+    {
+      count = -1;
+      break;
+    }
+    pHash->key[slot] = color;
+    pOut[count++] = color;
+  }
+  xfree(pHash);
+  return count;
+}
+
+static inline uint8_t binComponent(uint32_t bin, int axis)
+{
+  return (bin >> ((2 - axis) * HIST_BITS)) & ((1 << HIST_BITS) - 1);
+}
+
+/* Recompute the pixel count and the extent of a box from its bins */
+static void shrinkBox(CutBox *pBox, const uint32_t *pBins, const HistBin *pHist)
+{
+  int axis;
+  uint32_t i;
+  pBox->count = 0;
+  for (axis = 0; axis < 3; axis++)
+  {
+    pBox->min[axis] = 0xFF;
+    pBox->max[axis] = 0;
+  }
+  for (i = pBox->start; i < pBox->start + pBox->len; i++)
+  {
+    pBox->count += pHist[pBins[i]].count;
+    for (axis = 0; axis < 3; axis++)
+    {
+      uint8_t c = binComponent(pBins[i], axis);
+      if (c < pBox->min[axis]) pBox->min[axis] = c;
+      if (c > pBox->max[axis]) pBox->max[axis] = c;
+    }
+  }
+}
+
+/*
+  Split a box in two along its longest side, at the pixel-weighted median. The
+  bins are ordered along that axis with a counting sort, since there are only
+  2 ** HIST_BITS possible values.
+*/
+static void splitBox(CutBox *pBox, CutBox *pNew, uint32_t *pBins, uint32_t *pTmp, const HistBin *pHist)
+{
+  int axis = 0, i;
+  for (i = 1; i < 3; i++)
+    if (pBox->max[i] - pBox->min[i] > pBox->max[axis] - pBox->min[axis])
+      axis = i;
+
+  uint32_t offsets[(1 << HIST_BITS) + 1] = { 0 };
+  uint32_t j, *pSrc = pBins + pBox->start;
+  for (j = 0; j < pBox->len; j++)
+    offsets[binComponent(pSrc[j], axis) + 1]++;
+  for (i = 1; i <= 1 << HIST_BITS; i++)
+    offsets[i] += offsets[i - 1];
+  for (j = 0; j < pBox->len; j++)
+    pTmp[offsets[binComponent(pSrc[j], axis)]++] = pSrc[j];
+  memcpy(pSrc, pTmp, pBox->len * sizeof(uint32_t));
+
+  // Cut where half of the pixels are reached, leaving at least one bin per side
+  uint64_t acc = 0;
+  for (j = 0; j < pBox->len - 2; j++)
+  {
+    acc += pHist[pSrc[j]].count;
+    if (2 * acc >= pBox->count)
+      break;
+  }
+  pNew->start = pBox->start + j + 1;
+  pNew->len = pBox->len - j - 1;
+  pBox->len = j + 1;
+  shrinkBox(pBox, pBins, pHist);
+  shrinkBox(pNew, pBins, pHist);
+}
+
+/*
+  Median cut quantization of a packed RGB buffer. Images with few enough
+  colors get an exact palette. Otherwise, a 15-bit histogram is built in a
+  single pass, and its bins are recursively split until the desired amount of
+  boxes is reached, each of which produces the average color of its pixels.
+  Optionally, each pixel may carry a weight, e.g., when the pixels are the
+  colors of an already computed histogram.
+*/
+static int medianCut(const uint8_t *pRGB, const uint64_t *pWeights, size_t n, int max, uint32_t *pOut)
+{
+  int count = exactColors(pRGB, n, max, pOut);
+  if (count >= 0)
+    return count;
+
+  HistBin *pHist = ZALLOC_N(HistBin, HIST_LEN);
+  size_t i;
+  for (i = 0; i < n; i++)
+  {
+    const uint8_t *p = pRGB + 3 * i;
+    uint64_t weight = pWeights ? pWeights[i] : 1;
+    HistBin *pBin = &pHist[(p[0] >> 3) << 10 | (p[1] >> 3) << 5 | p[2] >> 3];
+    pBin->count += weight;
+    pBin->r += p[0] * weight;
+    pBin->g += p[1] * weight;
+    pBin->b += p[2] * weight;
+  }
+
+  uint32_t *pBins = ALLOC_N(uint32_t, HIST_LEN);
+  uint32_t *pTmp = ALLOC_N(uint32_t, HIST_LEN);
+  uint32_t bins = 0, j;
+  for (j = 0; j < HIST_LEN; j++)
+    if (pHist[j].count)
+      pBins[bins++] = j;
+
+  // Split the most significant box (pixels times extent) until we're done
+  CutBox *pBoxes = ALLOC_N(CutBox, max);
+  pBoxes[0].start = 0;
+  pBoxes[0].len = bins;
+  shrinkBox(&pBoxes[0], pBins, pHist);
+  count = 1;
+  while (count < max)
+  {
+    int best = -1, k, axis;
+    uint64_t bestScore = 0;
+    for (k = 0; k < count; k++)
+    {
+      if (pBoxes[k].len < 2)
+        continue;
+      uint32_t extent = 0;
+      for (axis = 0; axis < 3; axis++)
+        if ((uint32_t)(pBoxes[k].max[axis] - pBoxes[k].min[axis]) > extent)
+          extent = pBoxes[k].max[axis] - pBoxes[k].min[axis];
+      uint64_t score = pBoxes[k].count * (extent + 1);
+      if (score > bestScore)
+      {
+        bestScore = score;
+        best = k;
+      }
+    }
+    if (best < 0)
+      break;
+    splitBox(&pBoxes[best], &pBoxes[count++], pBins, pTmp, pHist);
+  }
+
+  int k;
+  for (k = 0; k < count; k++)
+  {
+    uint64_t r = 0, g = 0, b = 0, total = 0;
+    for (j = pBoxes[k].start; j < pBoxes[k].start + pBoxes[k].len; j++)
+    {
+      const HistBin *pBin = &pHist[pBins[j]];
+      r += pBin->r;
+      g += pBin->g;
+      b += pBin->b;
+      total += pBin->count;
+    }
+    pOut[k] = (uint32_t)((r + total / 2) / total) << 16
+            | (uint32_t)((g + total / 2) / total) << 8
+            | (uint32_t)((b + total / 2) / total);
+  }
+
+  xfree(pBoxes);
+  xfree(pTmp);
+  xfree(pBins);
+  xfree(pHist);
+  return count;
+}
+
+/* Index of the palette color closest to the given one (Euclidean in RGB) */
+static uint16_t nearestColor(const uint32_t *pPalette, const bool *pValid, int len, int r, int g, int b)
+{
+  uint32_t best = 0xFFFFFFFFu;
+  uint16_t index = 0;
+  int i;
+  for (i = 0; i < len; i++)
+  {
+    if (!pValid[i])
+      continue;
+    int dr = r - (int)(pPalette[i] >> 16 & 0xFF);
+    int dg = g - (int)(pPalette[i] >> 8 & 0xFF);
+    int db = b - (int)(pPalette[i] & 0xFF);
+    uint32_t dist = dr * dr + dg * dg + db * db;
+    if (dist < best)
+    {
+      best = dist;
+      index = i;
+    }
+  }
+  return index;
+}
+
+/* Read a Ruby list of colors (possibly with nils) into a palette */
+static int readPalette(VALUE colors, uint32_t *pPalette, bool *pValid)
+{
+  Check_Type(colors, T_ARRAY);
+  int i, len = RARRAY_LEN(colors), valid = 0;
+  if (len > 256)
+    rb_raise(rb_eArgError, "A palette can have at most 256 colors.");
+  for (i = 0; i < len; i++)
+  {
+    VALUE color = RARRAY_AREF(colors, i);
+    pValid[i] = !NIL_P(color);
+    pPalette[i] = pValid[i] ? NUM2UINT(color) & 0xFFFFFF : 0;
+    valid += pValid[i];
+  }
+  if (!valid)
+    rb_raise(rb_eArgError, "The palette has no colors.");
+  return len;
+}
+
+/*
+  Build a palette of at most `max` colors for a packed RGB buffer. Returns it
+  as a list of colors in the usual 0xRRGGBB format. The weights, if given, are
+  a packed string of native 64-bit integers, one per pixel.
+*/
+VALUE rgb_quantize(int argc, VALUE* argv, VALUE self)
+{
+  VALUE rgb, opt_max, weights;
+  rb_scan_args(argc, argv, "21", &rgb, &opt_max, &weights);
+  Check_Type(rgb, T_STRING);
+  int max = NUM2INT(opt_max);
+  if (max < 1 || max > 256)
+    rb_raise(rb_eArgError, "The amount of colors must be between 1 and 256.");
+  size_t n = RSTRING_LEN(rgb) / 3;
+  if (!NIL_P(weights))
+  {
+    Check_Type(weights, T_STRING);
+    if ((size_t)RSTRING_LEN(weights) < n * sizeof(uint64_t))
+      rb_raise(rb_eArgError, "Not enough weights for the colors.");
+  }
+
+  uint32_t palette[256];
+  const uint64_t *pWeights = NIL_P(weights) ? NULL : (const uint64_t*)RSTRING_PTR(weights);
+  int i, count = medianCut((const uint8_t*)RSTRING_PTR(rgb), pWeights, n, max, palette);
+  VALUE colors = rb_ary_new_capa(count);
+  for (i = 0; i < count; i++)
+    rb_ary_push(colors, UINT2NUM(palette[i]));
+  return colors;
+}
+
+/*
+  Lookup of the closest palette color for arbitrary colors. Colors present in
+  the palette are found exactly via a hash. The rest are looked up in an 18-bit
+  RGB cube, each cell of which is only matched against the palette the first
+  time it's used, so the cost stays linear in the pixels.
+*/
+typedef struct
+{
+  uint32_t palette[256];
+  bool valid[256];
+  int len;
+  ColorHash hash;
+  uint16_t cube[CUBE_LEN];
+} ColorMap;
+
+/* Reset the lookups of a map whose palette has just been read */
+static void colorMapBuild(ColorMap *pMap)
+{
+  memset(pMap->hash.key, 0xFF, sizeof(pMap->hash.key));
+  memset(pMap->cube, 0xFF, sizeof(pMap->cube));
+  int i;
+  for (i = 0; i < pMap->len; i++)
+  {
+    if (!pMap->valid[i])
+      continue;
+    uint32_t slot = hashSlot(&pMap->hash, pMap->palette[i]);
+    if (pMap->hash.key[slot] == HASH_EMPTY)
+    {
+      pMap->hash.key[slot] = pMap->palette[i];
+      pMap->hash.val[slot] = i;
+    }
+  }
+}
+
+static void colorMapInit(ColorMap *pMap, VALUE colors)
+{
+  pMap->len = readPalette(colors, pMap->palette, pMap->valid);
+  colorMapBuild(pMap);
+}
+
+/* Allocate a new map, reading the palette first, so that nothing leaks if it's invalid */
+static ColorMap *colorMapNew(VALUE colors)
+{
+  uint32_t palette[256];
+  bool valid[256];
+  int len = readPalette(colors, palette, valid);
+  ColorMap *pMap = ALLOC(ColorMap);
+  memcpy(pMap->palette, palette, len * sizeof(uint32_t));
+  memcpy(pMap->valid, valid, len * sizeof(bool));
+  pMap->len = len;
+  colorMapBuild(pMap);
+  return pMap;
+}
+
+static inline uint8_t colorMapFind(ColorMap *pMap, uint8_t r, uint8_t g, uint8_t b)
+{
+  uint32_t slot = hashSlot(&pMap->hash, (uint32_t)r << 16 | (uint32_t)g << 8 | b);
+  if (pMap->hash.key[slot] != HASH_EMPTY)
+    return pMap->hash.val[slot];
+  const int shift = 8 - CUBE_BITS, half = 1 << (shift - 1);
+  uint32_t cell = (r >> shift) << (2 * CUBE_BITS) | (g >> shift) << CUBE_BITS | b >> shift;
+  if (pMap->cube[cell] == LUT_EMPTY)
+    pMap->cube[cell] = nearestColor(pMap->palette, pMap->valid, pMap->len,
+      (r >> shift << shift) + half, (g >> shift << shift) + half, (b >> shift << shift) + half);
+  return pMap->cube[cell];
+}
+
+static VALUE colorMapApply(ColorMap *pMap, VALUE rgb)
+{
+  Check_Type(rgb, T_STRING);
+  const uint8_t *pRGB = (const uint8_t*)RSTRING_PTR(rgb);
+  size_t n = RSTRING_LEN(rgb) / 3, j;
+  VALUE pixels = rb_str_new(NULL, n);
+  uint8_t *pOut = (uint8_t*)RSTRING_PTR(pixels);
+  for (j = 0; j < n; j++)
+    pOut[j] = colorMapFind(pMap, pRGB[3 * j], pRGB[3 * j + 1], pRGB[3 * j + 2]);
+  return pixels;
+}
+
+/* Arguments of a temporary map application, passed through rb_ensure */
+typedef struct
+{
+  ColorMap *pMap;
+  VALUE rgb;
+} ColorMapCall;
+
+static VALUE rgb_map_body(VALUE arg)
+{
+  ColorMapCall *pCall = (ColorMapCall*)arg;
+  return colorMapApply(pCall->pMap, pCall->rgb);
+}
+
+static VALUE rgb_map_done(VALUE arg)
+{
+  xfree(((ColorMapCall*)arg)->pMap);
+  return Qnil;
+}
+
+/* Map a packed RGB buffer to the indices of the closest colors of a palette */
+VALUE rgb_map(VALUE self, VALUE rgb, VALUE colors)
+{
+  Check_Type(rgb, T_STRING);
+  ColorMapCall call = { colorMapNew(colors), rgb };
+  return rb_ensure(rgb_map_body, (VALUE)&call, rgb_map_done, (VALUE)&call);
+}
+
+/*
+  Pack a list of colors in the 0xRRGGBB format into a packed RGB buffer, with
+  3 bytes per color, as they appear in color tables. Nils are packed as black.
+*/
+VALUE rgb_pack(VALUE self, VALUE colors)
+{
+  Check_Type(colors, T_ARRAY);
+  long i, len = RARRAY_LEN(colors);
+  VALUE rgb = rb_str_new(NULL, 3 * len);
+  uint8_t *pRGB = (uint8_t*)RSTRING_PTR(rgb);
+  for (i = 0; i < len; i++)
+  {
+    VALUE color = RARRAY_AREF(colors, i);
+    uint32_t c = NIL_P(color) ? 0 : NUM2UINT(color);
+    pRGB[3 * i]     = c >> 16 & 0xFF;
+    pRGB[3 * i + 1] = c >> 8  & 0xFF;
+    pRGB[3 * i + 2] = c       & 0xFF;
+  }
+  return rgb;
+}
+
+static size_t color_map_memsize(const void *ptr)
+{
+  return sizeof(ColorMap);
+}
+
+static const rb_data_type_t color_map_type = {
+  "Gifenc::ColorMap",
+  { NULL, RUBY_TYPED_DEFAULT_FREE, color_map_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*
+  A persistent ColorMap, so that a palette can answer nearest color queries
+  repeatedly, with the RGB cube filling up across calls.
+*/
+VALUE color_map_alloc(VALUE klass)
+{
+  ColorMap *pMap;
+  return TypedData_Make_Struct(klass, ColorMap, &color_map_type, pMap);
+}
+
+VALUE color_map_initialize(VALUE self, VALUE colors)
+{
+  ColorMap *pMap;
+  TypedData_Get_Struct(self, ColorMap, &color_map_type, pMap);
+  colorMapInit(pMap, colors);
+  return self;
+}
+
+static ColorMap *color_map_get(VALUE self)
+{
+  ColorMap *pMap;
+  TypedData_Get_Struct(self, ColorMap, &color_map_type, pMap);
+  if (!pMap->len)
+    rb_raise(rb_eRuntimeError, "Color map not initialized.");
+  return pMap;
+}
+
+/* Index of the closest palette color to a 0xRRGGBB color */
+VALUE color_map_find(VALUE self, VALUE color)
+{
+  ColorMap *pMap = color_map_get(self);
+  uint32_t c = NUM2UINT(color);
+  return INT2FIX(colorMapFind(pMap, c >> 16 & 0xFF, c >> 8 & 0xFF, c & 0xFF));
+}
+
+/* Map a packed RGB buffer to the indices of the closest palette colors */
+VALUE color_map_map(VALUE self, VALUE rgb)
+{
+  return colorMapApply(color_map_get(self), rgb);
+}
+
+/* State of a histogram call, performed without the GVL */
+typedef struct
+{
+  const uint8_t *pPixels;
+  size_t len;
+  size_t stride;
+  uint64_t counts[256];
+} HistogramCall;
+
+static void *index_histogram_nogvl(void *ptr)
+{
+  HistogramCall *pCall = (HistogramCall*)ptr;
+  size_t i;
+  for (i = 0; i < pCall->len; i += pCall->stride)
+    pCall->counts[pCall->pPixels[i]]++;
+  return NULL;
+}
+
+/*
+  Count the occurrences of each color index in a string of indexed pixels,
+  sampling one every `stride` pixels. Runs without the GVL, so that several
+  frames can be sampled in parallel from different threads.
+*/
+VALUE index_histogram(VALUE self, VALUE pixels, VALUE opt_stride)
+{
+  Check_Type(pixels, T_STRING);
+  long stride = NUM2LONG(opt_stride);
+  if (stride < 1)
+    rb_raise(rb_eArgError, "The sampling stride must be positive.");
+
+  pixels = rb_str_new_frozen(pixels);
+  HistogramCall call = { (const uint8_t*)RSTRING_PTR(pixels), RSTRING_LEN(pixels), stride, { 0 } };
+  rb_thread_call_without_gvl(index_histogram_nogvl, &call, NULL, NULL);
+  RB_GC_GUARD(pixels);
+
+  VALUE counts = rb_ary_new_capa(256);
+  int i;
+  for (i = 0; i < 256; i++)
+    rb_ary_push(counts, ULL2NUM(call.counts[i]));
+  return counts;
+}
+
+/* 8x8 Bayer threshold matrix, with values 0 to 63 */
+static const uint8_t bayer8[8][8] = {
+  {  0, 32,  8, 40,  2, 34, 10, 42 },
+  { 48, 16, 56, 24, 50, 18, 58, 26 },
+  { 12, 44,  4, 36, 14, 46,  6, 38 },
+  { 60, 28, 52, 20, 62, 30, 54, 22 },
+  {  3, 35, 11, 43,  1, 33,  9, 41 },
+  { 51, 19, 59, 27, 49, 17, 57, 25 },
+  { 15, 47,  7, 39, 13, 45,  5, 37 },
+  { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+enum { DITHER_FLOYD_STEINBERG, DITHER_BAYER };
+
+/* Columns a Floyd-Steinberg row finishes between publishing its progress */
+#define DITHER_PUBLISH 32
+
+/*
+  A dithering job over a whole packed RGB buffer, written straight into the
+  pixel buffer of an image, which several threads run at once. Each worker
+  takes every n-th row and has its own color map and scratch row, all of them
+  allocated upfront, so that running a worker can't fail halfway and leave the
+  others waiting.
+*/
+typedef struct
+{
+  VALUE rgb;
+  VALUE pixels;
+  long width;
+  long height;
+  int type;
+  int workers;
+  ColorMap **pMaps;
+  uint8_t **pRows;     // Biased row of each worker (Bayer)
+  bool *pStarted;
+  int32_t *pBuf;       // 2 error rows (Floyd-Steinberg) or 8 bias rows (Bayer)
+  rb_atomic_t *pDone;  // Columns of error each row has finished (Floyd-Steinberg)
+  rb_atomic_t aborted; // Set to stop all the workers (see dither_abort)
+} DitherJob;
+
+/* Call of one worker of a dithering job, performed without the GVL */
+typedef struct
+{
+  DitherJob *pJob;
+  const uint8_t *pRGB;
+  uint8_t *pOut;
+  int worker;
+} DitherCall;
+
+static inline uint8_t clampByte(int32_t v)
+{
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline void yieldThread(void)
+{
+#ifdef HAVE_SCHED_H
+  sched_yield();
+#endif
+}
+
+/*
+  Ordered dithering: a fixed bias from the Bayer matrix is added to each pixel
+  before mapping it. The 8 possible bias rows are expanded to the full width
+  once, so that biasing a row is a straight loop over its bytes which the
+  compiler vectorizes. Rows are independent, so workers need no coordination.
+*/
+static void ditherBayer(DitherCall *pCall)
+{
+  DitherJob *pJob = pCall->pJob;
+  ColorMap *pMap = pJob->pMaps[pCall->worker];
+  uint8_t *pRow = pJob->pRows[pCall->worker];
+  long w = pJob->width, x, y, i;
+  for (y = pCall->worker; y < pJob->height; y += pJob->workers)
+  {
+    if (RUBY_ATOMIC_LOAD(pJob->aborted))
+      return;
+    const uint8_t *pSrc = pCall->pRGB + 3 * y * w;
+    const int32_t *pBias = pJob->pBuf + (y & 7) * 3 * w;
+    for (i = 0; i < 3 * w; i++)
+      pRow[i] = clampByte(pSrc[i] + pBias[i]);
+    uint8_t *pDst = pCall->pOut + y * w;
+    for (x = 0; x < w; x++)
+      pDst[x] = colorMapFind(pMap, pRow[3 * x], pRow[3 * x + 1], pRow[3 * x + 2]);
+  }
+}
+
+/*
+  Floyd-Steinberg error diffusion: the quantization error of each pixel is
+  spread to its unprocessed neighbours (7/16 right, 3/16 below left, 5/16 below,
+  1/16 below right), kept scaled by 16. The error to the right is carried in
+  registers, and that of the row below is summed up as the row advances, each
+  column being written once it's final.
+
+  Since a pixel only needs the error of the 3 pixels above it, rows are
+  pipelined across the workers: each row follows the one above (run by another
+  worker) a few columns behind, waiting whenever it catches up. Two error rows
+  suffice, because the row that reads one is always ahead of the row that
+  overwrites it. The result is the same regardless of the amount of workers.
+  If the job is aborted, every worker stops, even while waiting.
+*/
+static void ditherFloydSteinberg(DitherCall *pCall)
+{
+  DitherJob *pJob = pCall->pJob;
+  ColorMap *pMap = pJob->pMaps[pCall->worker];
+  long w = pJob->width, h = pJob->height, x, y;
+  int c;
+  for (y = pCall->worker; y < h; y += pJob->workers)
+  {
+    if (RUBY_ATOMIC_LOAD(pJob->aborted))
+      return;
+    const uint8_t *pSrc = pCall->pRGB + 3 * y * w;
+    uint8_t *pDst = pCall->pOut + y * w;
+    const int32_t *pCur = pJob->pBuf + (y & 1) * 3 * w;
+    int32_t *pNext = y + 1 < h ? pJob->pBuf + (~y & 1) * 3 * w : NULL;
+    int32_t right[3] = { 0 }, prev[3] = { 0 }, cur[3] = { 0 };
+    long avail = y > 0 ? 0 : w;
+    for (x = 0; x < w; x++)
+    {
+      // Wait for the row above to finish the error of this column
+      while (avail <= x)
+      {
+        if ((avail = RUBY_ATOMIC_LOAD(pJob->pDone[y - 1])) > x)
+          break;
+        if (RUBY_ATOMIC_LOAD(pJob->aborted))
+          return;
+        yieldThread();
+      }
+
+      uint8_t v[3];
+      for (c = 0; c < 3; c++)
+        v[c] = clampByte(pSrc[3 * x + c] + ((y > 0 ? pCur[3 * x + c] : 0) + right[c] + 8) / 16);
+      uint8_t index = colorMapFind(pMap, v[0], v[1], v[2]);
+      uint32_t q = pMap->palette[index];
+      pDst[x] = index;
+      for (c = 0; c < 3; c++)
+      {
+        int32_t e = v[c] - (int32_t)(q >> (16 - 8 * c) & 0xFF);
+        right[c] = 7 * e;
+        if (pNext && x > 0)
+          pNext[3 * (x - 1) + c] = prev[c] + 3 * e;
+        prev[c] = cur[c] + 5 * e;
+        cur[c] = e;
+      }
+      if (x % DITHER_PUBLISH == 0)
+        RUBY_ATOMIC_SET(pJob->pDone[y], x);
+    }
+    if (pNext)
+      for (c = 0; c < 3; c++)
+        pNext[3 * (w - 1) + c] = prev[c];
+    RUBY_ATOMIC_SET(pJob->pDone[y], w);
+  }
+}
+
+static void *dither_nogvl(void *ptr)
+{
+  DitherCall *pCall = (DitherCall*)ptr;
+  if (pCall->pJob->type == DITHER_BAYER)
+    ditherBayer(pCall);
+  else
+    ditherFloydSteinberg(pCall);
+  return NULL;
+}
+
+/* Unblocking function of the workers: interrupting any of them stops them all */
+static void dither_ubf(void *ptr)
+{
+  RUBY_ATOMIC_SET(((DitherJob*)ptr)->aborted, 1);
+}
+
+static void dither_mark(void *ptr)
+{
+  DitherJob *pJob = (DitherJob*)ptr;
+  rb_gc_mark(pJob->rgb);
+  rb_gc_mark(pJob->pixels);
+}
+
+static void dither_free(void *ptr)
+{
+  DitherJob *pJob = (DitherJob*)ptr;
+  int i;
+  for (i = 0; i < pJob->workers; i++)
+  {
+    if (pJob->pMaps) xfree(pJob->pMaps[i]);
+    if (pJob->pRows) xfree(pJob->pRows[i]);
+  }
+  xfree(pJob->pMaps);
+  xfree(pJob->pRows);
+  xfree(pJob->pStarted);
+  xfree(pJob->pBuf);
+  xfree(pJob->pDone);
+  xfree(pJob);
+}
+
+static size_t dither_memsize(const void *ptr)
+{
+  const DitherJob *pJob = (const DitherJob*)ptr;
+  return sizeof(DitherJob) + pJob->workers * sizeof(ColorMap);
+}
+
+static const rb_data_type_t dither_type = {
+  "Gifenc::Dither",
+  { dither_mark, dither_free, dither_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+VALUE dither_alloc(VALUE klass)
+{
+  DitherJob *pJob;
+  VALUE self = TypedData_Make_Struct(klass, DitherJob, &dither_type, pJob);
+  pJob->rgb = Qnil;
+  pJob->pixels = Qnil;
+  return self;
+}
+
+/*
+  Prepare the dithering of a packed RGB buffer of the given width into the
+  color indices of a palette, to be written into an existing pixel buffer of
+  the same dimensions by the given amount of workers (see dither_run). The
+  method is either :floyd_steinberg or :bayer.
+*/
+VALUE dither_initialize(VALUE self, VALUE rgb, VALUE opt_w, VALUE colors, VALUE pixels, VALUE method, VALUE opt_workers)
+{
+  DitherJob *pJob;
+  TypedData_Get_Struct(self, DitherJob, &dither_type, pJob);
+  if (pJob->pMaps)
+    rb_raise(rb_eRuntimeError, "Dithering job already initialized.");
+  Check_Type(rgb, T_STRING);
+  Check_Type(pixels, T_STRING);
+  Check_Type(method, T_SYMBOL);
+  long w = NUM2LONG(opt_w);
+  int workers = NUM2INT(opt_workers);
+  if (w <= 0 || RSTRING_LEN(pixels) % w)
+    rb_raise(rb_eArgError, "Invalid dimensions.");
+  long h = RSTRING_LEN(pixels) / w;
+  if (RSTRING_LEN(rgb) < 3 * w * h)
+    rb_raise(rb_eArgError, "Pixel data doesn't match the dimensions.");
+  if (workers < 1 || workers > (h > 0 ? h : 1))
+    rb_raise(rb_eArgError, "Invalid amount of workers.");
+  int type;
+  if (SYM2ID(method) == rb_intern("floyd_steinberg"))
+    type = DITHER_FLOYD_STEINBERG;
+  else if (SYM2ID(method) == rb_intern("bayer"))
+    type = DITHER_BAYER;
+  else
+    rb_raise(rb_eArgError, "Unknown dithering method.");
+
+  rb_str_modify(pixels);
+  pJob->rgb = rb_str_new_frozen(rgb);
+  pJob->pixels = pixels;
+  pJob->width = w;
+  pJob->height = h;
+  pJob->type = type;
+  pJob->pMaps = ZALLOC_N(ColorMap*, workers);
+  pJob->pRows = ZALLOC_N(uint8_t*, workers);
+  pJob->workers = workers;
+  pJob->pStarted = ZALLOC_N(bool, workers);
+  int i;
+  for (i = 0; i < workers; i++)
+    pJob->pMaps[i] = colorMapNew(colors);
+
+  if (type == DITHER_BAYER)
+  {
+    // Bias spans one step between palette levels, assuming them uniform per channel
+    ColorMap *pMap = pJob->pMaps[0];
+    int valid = 0;
+    for (i = 0; i < pMap->len; i++)
+      valid += pMap->valid[i];
+    int32_t spread = valid > 1 ? (int32_t)(255 / (cbrt(valid) - 1)) : 0;
+    long x, y;
+    pJob->pBuf = ALLOC_N(int32_t, 8 * 3 * w);
+    for (y = 0; y < 8; y++)
+      for (x = 0; x < 3 * w; x++)
+        pJob->pBuf[y * 3 * w + x] = (2 * bayer8[y][(x / 3) & 7] + 1 - 64) * spread / 128;
+    for (i = 0; i < workers; i++)
+      pJob->pRows[i] = ALLOC_N(uint8_t, 3 * w);
+  }
+  else
+  {
+    pJob->pBuf = ALLOC_N(int32_t, 2 * 3 * w);
+    pJob->pDone = ZALLOC_N(rb_atomic_t, h > 0 ? h : 1);
+  }
+  return self;
+}
+
+/*
+  Run one worker of a dithering job, which takes the rows whose index modulo
+  the amount of workers is its own. Runs without the GVL, and every worker must
+  be run exactly once, each from a different thread, since Floyd-Steinberg
+  workers wait for the rows of the others. Raises if the job is aborted before
+  the worker finishes, either by dither_abort or by interrupting any worker.
+*/
+VALUE dither_run(VALUE self, VALUE opt_worker)
+{
+  DitherJob *pJob;
+  TypedData_Get_Struct(self, DitherJob, &dither_type, pJob);
+  if (!pJob->pMaps)
+    rb_raise(rb_eRuntimeError, "Dithering job not initialized.");
+  int worker = NUM2INT(opt_worker);
+  if (worker < 0 || worker >= pJob->workers)
+    rb_raise(rb_eArgError, "Invalid worker.");
+  if (pJob->pStarted[worker])
+    rb_raise(rb_eRuntimeError, "Worker already run.");
+  if (RSTRING_LEN(pJob->pixels) < pJob->width * pJob->height)
+    rb_raise(rb_eArgError, "Pixel data doesn't match the dimensions.");
+  pJob->pStarted[worker] = true;
+
+  rb_str_modify(pJob->pixels);
+  DitherCall call = {
+    pJob,
+    (const uint8_t*)RSTRING_PTR(pJob->rgb),
+    (uint8_t*)RSTRING_PTR(pJob->pixels),
+    worker
+  };
+  rb_thread_call_without_gvl(dither_nogvl, &call, dither_ubf, pJob);
+  RB_GC_GUARD(self);
+  if (RUBY_ATOMIC_LOAD(pJob->aborted))
+  {
+    rb_thread_check_ints();
+    rb_raise(rb_eRuntimeError, "Dithering aborted.");
+  }
+  return pJob->pixels;
+}
+
+/* Stop all the workers of a dithering job, e.g. when one of them failed to run */
+VALUE dither_abort(VALUE self)
+{
+  DitherJob *pJob;
+  TypedData_Get_Struct(self, DitherJob, &dither_type, pJob);
+  RUBY_ATOMIC_SET(pJob->aborted, 1);
+  return Qnil;
+}
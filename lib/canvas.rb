@@ -0,0 +1,155 @@
+module Gifenc
+  # A truecolor canvas, which holds actual RGB colors rather than indices into
+  # a color table. This is the "canvas mode" of working: pixels are drawn (or
+  # rendered elsewhere and supplied in bulk) in real colors, and a palette is
+  # only fitted at the end, when converting the canvas to an {Image}.
+  #
+  # The pixels are stored as a packed binary string with 3 bytes (R, G, B) per
+  # pixel, in row-major order, and colors are given as integers in the usual
+  # `0xRRGGBB` format, like in a {ColorTable}.
+  #
+  # Most methods modifying the canvas return the canvas itself, so that they can
+  # be chained properly.
+  class Canvas
+
+    # Width of the canvas in pixels.
+    # @return [Integer] Canvas width.
+    attr_reader :width
+
+    # Height of the canvas in pixels.
+    # @return [Integer] Canvas height.
+    attr_reader :height
+
+    # The raw pixel data of the canvas, as a packed RGB string. To change it in
+    # bulk, use {#replace}.
+    # @return [String] The pixel data.
+    attr_reader :data
+
+    # Create a new truecolor canvas.
+    # @param width [Integer] Width of the canvas in pixels.
+    # @param height [Integer] Height of the canvas in pixels.
+    # @param color [Integer] The initial color of the canvas, as `0xRRGGBB`.
+    # @param data [String] Initialize the canvas with this packed RGB data
+    #   instead of a solid color (see {#replace}).
+    # @return [Canvas] The canvas.
+    # @raise [Exception::CanvasError] If the data doesn't match the dimensions.
+    def initialize(width, height, color: 0x000000, data: nil)
+      @width  = width
+      @height = height
+      return replace(data) if data
+      @data = [color].pack('N')[1, 3].b * (@width * @height)
+    end
+
+    # Change the pixel data of the canvas. The string isn't copied: the canvas
+    # shares its buffer until either of them is modified.
+    # @param data [String] The new pixel data, as a packed RGB string.
+    # @return (see #initialize)
+    # @raise [Exception::CanvasError] If the data doesn't match the dimensions.
+    def replace(data)
+      if data.bytesize != 3 * @width * @height
+        raise Exception::CanvasError, "RGB data doesn't match canvas dimensions."
+      end
+      @data = data.dup.force_encoding(Encoding::BINARY)
+      self
+    end
+
+    # Get the color of a single pixel, without bound checks.
+    # @param x [Integer] X coordinate of the pixel.
+    # @param y [Integer] Y coordinate of the pixel.
+    # @return [Integer] The color of the pixel, as `0xRRGGBB`.
+    def [](x, y)
+      i = 3 * (y * @width + x)
+      @data.getbyte(i) << 16 | @data.getbyte(i + 1) << 8 | @data.getbyte(i + 2)
+    end
+
+    # Set the color of a single pixel, without bound checks.
+    # @param x [Integer] X coordinate of the pixel.
+    # @param y [Integer] Y coordinate of the pixel.
+    # @param color [Integer] The new color of the pixel, as `0xRRGGBB`.
+    def []=(x, y, color)
+      i = 3 * (y * @width + x)
+      @data.setbyte(i,     color >> 16 & 0xFF)
+      @data.setbyte(i + 1, color >> 8  & 0xFF)
+      @data.setbyte(i + 2, color       & 0xFF)
+    end
+
+    # Find a palette that best represents the colors of the canvas. If the
+    # canvas has few enough colors, they're used exactly, in order of appearance.
+    # Otherwise, they're reduced using the median cut algorithm over a 15-bit
+    # color histogram. Both run in linear time with the amount of pixels.
+    # @param colors [Integer] Maximum amount of colors for the palette (1-256).
+    # @return [ColorTable] The new color table.
+    # @raise [Exception::ColorTableError] If the amount of colors is invalid.
+    def quantize(colors = ColorTable::MAX_SIZE)
+      if !colors.between?(1, ColorTable::MAX_SIZE)
+        raise Exception::ColorTableError, "A color table must have between 1 and #{ColorTable::MAX_SIZE} colors."
+      end
+      ColorTable.new(Gifenc.rgb_quantize(@data, colors)) # Refer to quantize.c
+    end
+
+    # Convert the canvas to a paletted image by fitting it to a color table.
+    # Every pixel is mapped to the closest color of the table, which is fast
+    # even for large canvases, since colors are looked up in an RGB cube (see
+    # {ColorTable#nearest}).
+    # Optionally, the canvas can be dithered, which hides the banding caused by
+    # reducing the colors:
+    # * `:bayer`: Ordered dithering with an 8x8 Bayer matrix. Every pixel is
+    #   independent, which makes it the fastest, and stable between frames.
+    # * `:floyd_steinberg`: Floyd-Steinberg error diffusion. Better quality,
+    #   but each pixel depends on the previous ones. When using several threads,
+    #   rows are pipelined: each thread takes every n-th row and follows the row
+    #   above a few pixels behind, so the result is exactly the same as with a
+    #   single thread.
+    # @param table [ColorTable] The color table to fit the canvas to. If not
+    #   provided, a new one is built with {#quantize}.
+    # @param colors [Integer] Maximum amount of colors when building the table.
+    # @param dither [Symbol] Dithering method, either `:bayer`, `:floyd_steinberg`
+    #   or `nil` (default) for none.
+    # @param threads [Integer] Amount of threads to dither with, each taking
+    #   every n-th row. It's capped to the amount of processors.
+    # @param options [Hash] Any other options to build the {Image} with (see
+    #   {Image#initialize}). By default, the table is set as the image's local
+    #   one, pass `lct: nil` if it's instead the global table of the GIF.
+    # @return [Image] The new image.
+    # @raise [Exception::CanvasError] If the dithering method is unknown.
+    def to_image(table: nil, colors: ColorTable::MAX_SIZE, dither: nil, threads: 1, **options)
+      table ||= quantize(colors)
+      options = { lct: table }.merge(options)
+      if !dither
+        pixels = table.map_rgb(@data)
+        return Image.new(@width, @height, **options).replace(pixels)
+      end
+      if ![:bayer, :floyd_steinberg].include?(dither)
+        raise Exception::CanvasError, "Unknown dithering method #{dither}."
+      end
+
+      # Dither straight into the pixels of the image, each thread doing a share
+      # of the rows. Every worker must run on its own thread, since they wait
+      # for each other's rows, so if any of them fails the rest are stopped.
+      # More threads than cores would only take turns waiting.
+      image = Image.new(@width, @height, **options)
+      workers = [[threads, @height, Etc.nprocessors].min, 1].max
+      job = Dither.new(@data, @width, table.colors, image.pixels, dither, workers) # Refer to quantize.c
+      if workers == 1
+        job.run(0)
+        return image
+      end
+      pool = []
+      begin
+        workers.times{ |i|
+          pool << Thread.new{
+            Thread.current.report_on_exception = false
+            job.run(i)
+          }
+        }
+        pool.each(&:join)
+      ensure
+        if pool.size < workers || pool.any?{ |t| t.alive? || t.status.nil? }
+          job.abort
+          pool.each{ |t| t.join rescue nil }
+        end
+      end
+      image
+    end
+  end
+end
@@ -1,5 +1,3 @@
-require 'set'
-
 module Gifenc
   # The color table is the palette of the GIF, it contains all the colors that
   # may appear in any of its images. The color table can be *global* (GCT), in
@@ -52,8 +50,27 @@ module Gifenc
     # color list in bulk, use the {#set} method. To change individual colors,
     # use the {#replace} method.
     # @return [Array<Integer>] The raw list of colors.
+    # @note If this list is modified directly, call {#update} afterwards.
     attr_reader :colors
 
+    # Whether to update the inverse lookup of the table (from colors to their
+    # indices, see {#index}) right after every modification, which is the default.
+    # Changes to individual colors ({#add}, {#delete}, {#replace}) only update
+    # the slots they touch, whereas the rest rebuild the whole lookup.
+    # Otherwise, the lookup is only marked as outdated, and it's rebuilt the next
+    # time it's needed, or when calling {#update}. Disabling it is useful when
+    # performing many modifications in a row.
+    # @return [Boolean] Auto-update policy.
+    attr_accessor :auto_update
+
+    # How the indices changed during the last operation that moved colors around
+    # the table ({#uniq}, {#compact}, {#simplify}, {#permute}, {#cycle} or {#swap}).
+    # It's a lookup table where the byte at each old index is the new index of
+    # that color, which can be passed to {Image#remap} or {Gif#remap} to update
+    # the pixels that use this table, so that they look the same.
+    # @return [String] 256-byte lookup table, or `nil` if no colors moved yet.
+    attr_reader :mapping
+
     # Creates a new color table. This color table can then be used as a GCT,
     # as an LCT for as many images as desired, or both.
     # @param colors [Array<Integer>] An ordered list of colors to initialize the
@@ -65,27 +82,42 @@ module Gifenc
     #   color depth (that is always 8), and is ignored by most decoders.
     # @param sorted [Boolean] Indicates that the colors in the table are sorted
     #   by importance. It's essentially a deprecated flag that most decoders ignore.
+    # @param auto_update [Boolean] Update the inverse lookup of the table after
+    #   every modification (see {#auto_update}).
     # @return [ColorTable] The color table.
-    def initialize(colors = [], depth: 8, sorted: false)
+    def initialize(colors = [], depth: 8, sorted: false, auto_update: true)
+      @auto_update = auto_update
       clear
       @depth = depth.clamp(1, 8)
       @sorted = sorted
       set(colors)
     end
 
+    # Decode a color table from a GIF file.
+    # @param data [String] The GIF data.
+    # @param offset [Integer] The offset of the color table in the data.
+    # @param bit_size [Integer] The bit size of the table (1-8), as specified in
+    #   the corresponding descriptor. The table will contain `2 ** bit_size` colors.
+    # @param depth [Integer] Color resolution of the original image (see {#depth}).
+    # @param sorted [Boolean] Whether the colors are sorted (see {#sorted}).
+    # @return [ColorTable] The decoded color table.
+    def self.decode(data, offset, bit_size, depth: 8, sorted: false)
+      colors = data.byteslice(offset, 3 * 2 ** bit_size).unpack('C*').each_slice(3).map{ |r, g, b|
+        r << 16 | g << 8 | b
+      }
+      new(colors, depth: depth, sorted: sorted)
+    end
+
     # Encode the color table as it will appear in the GIF.
     # @param stream [IO] The stream to output the encoded color table into.
     def encode(stream)
-      @colors.take(size).each{ |c|
-        c = 0 if !c
-        stream << [c >> 16 & 0xFF, c >> 8 & 0xFF, c & 0xFF].pack('C3')
-      }
+      stream << Gifenc.rgb_pack(@colors.take(size)) # Refer to quantize.c
     end
 
     # Create a duplicate copy of this color table.
     # @return [ColorTable] The new color table.
     def dup
-      ColorTable.new(@colors.dup, depth: @depth, sorted: @sorted)
+      ColorTable.new(@colors.dup, depth: @depth, sorted: @sorted, auto_update: @auto_update)
     end
 
     # Pack GCT flags into a byte as they appear in the GIF.
@@ -112,7 +144,7 @@ module Gifenc
           has more than #{MAX_SIZE} entries."
       end
       colors.each_with_index{ |c, i| @colors[i] = !!c ? c & 0xFFFFFF : nil }
-      self
+      changed
     end
 
     # Eliminates duplicate colors from the color table. This will keep the first
@@ -122,16 +154,10 @@ module Gifenc
     # @return (see #initialize)
     # @see #simplify
     def uniq
-      unique_colors = Set.new
-      for i in (0 ... MAX_SIZE)
-        next if !@colors[i]
-        if unique_colors.include?(@colors[i])
-          @colors[i] = nil
-        else
-          unique_colors.add(@colors[i])
-        end
-      end
-      self
+      track{
+        @colors.each_with_index{ |c, i| @colors[i] = nil if c && index(c) != i }
+        changed
+      }
     end
 
     # Rearrange all colors to remove empty intermediate slots. This is accomplished
@@ -141,9 +167,11 @@ module Gifenc
     # @note (see #set)
     # @see #simplify
     def compact
-      @colors.compact!
-      @colors += [nil] * (MAX_SIZE - @colors.size)
-      self
+      track{
+        @colors.compact!
+        @colors += [nil] * (MAX_SIZE - @colors.size)
+        changed
+      }
     end
 
     # Simplifies the color table by removing color duplicates and empty slots.
@@ -153,8 +181,10 @@ module Gifenc
     # @see #compact
     # @note (see #set)
     def simplify
-      uniq
-      compact
+      track{
+        uniq
+        compact
+      }
     end
 
     # Empties the whole color table, bringing its size down to 0.
@@ -162,7 +192,7 @@ module Gifenc
     # @note (see #set)
     def clear
       @colors = [nil] * MAX_SIZE
-      self
+      changed
     end
 
     alias_method :reset, :clear
@@ -185,14 +215,15 @@ module Gifenc
       end
 
       # Ensure provided colors are in the table
-      if !(colors - @colors).empty?
+      if !colors.all?{ |c| include?(c) }
         raise Exception::ColorTableError, "Cannot permute colors: Color not found."
       end
 
       mapping = colors.each_with_index.map{ |c, i| [c, colors[order[i]]] }.to_h
-      @colors.map!{ |c| mapping[c] || c }
-      
-      self
+      track{
+        @colors.map!{ |c| mapping[c] || c }
+        changed
+      }
     end
 
     # Rearrange a subset of colors in the table according to a cycle. For
@@ -204,7 +235,7 @@ module Gifenc
     # @see #permute
     # @raise [Exception::ColorTableError] If any color was not found in the color table.
     def cycle(*colors, step: 1)
-      permutation = colors.times.map{ |i| (i - step) % colors.size }
+      permutation = colors.size.times.map{ |i| (i - step) % colors.size }
       permute(*colors, order: permutation)
     end
 
@@ -224,12 +255,13 @@ module Gifenc
     # @raise [Exception::ColorTableError] If there's not enough space in the table to add
     #   the new colors.
     def add(*colors)
-      colors = (colors - @colors).compact.uniq
-      if count + colors.size > MAX_SIZE
+      colors = colors.compact.map{ |c| c & 0xFFFFFF }.uniq.reject{ |c| include?(c) }
+      slots = free_slots.first(colors.size)
+      if colors.size > slots.size
         raise Exception::ColorTableError, "Cannot add colors to the color table:\
           Table over size limit (#{MAX_SIZE})."
       end
-      colors.each{ |c| @colors[find_slot] = c & 0xFFFFFF }
+      colors.each_with_index{ |c, i| assign(slots[i], c) }
       self
     end
 
@@ -237,7 +269,7 @@ module Gifenc
     # @param colors [Integers] The colors to delete.
     # @return (see #initialize)
     def delete(*colors)
-      colors.each{ |c| replace(c, nil) }
+      colors.uniq.each{ |c| slots_of(c).each{ |i| assign(i, nil) } }
       self
     end
 
@@ -247,14 +279,70 @@ module Gifenc
     # @return (see #initialize)
     def replace(old_color, new_color)
       new_color = !!new_color ? new_color & 0xFFFFFF : nil
-      @colors.map!{ |c| c == old_color ? new_color : c }
+      slots_of(old_color).each{ |i| assign(i, new_color) }
       self
     end
 
     # Inverts all the colors in the table.
     # @return (see #initialize)
     def invert
-      @colors.each{ |c| replace(c, c ^ 0xFFFFFF) }
+      @colors.map!{ |c| c && c ^ 0xFFFFFF }
+      changed
+    end
+
+    # Find the index of a color in the table. This uses an inverse lookup, so
+    # it takes constant time.
+    # @param color [Integer] The color to find.
+    # @return [Integer] The index of the first slot with the color, or `nil` if
+    #   it's not in the table.
+    # @see #nearest
+    def index(color)
+      update if @outdated
+      slots = @slots[color]
+      slots && slots[0]
+    end
+
+    # Whether a color is present in the table.
+    # @param color [Integer] The color to find.
+    # @return [Boolean] Whether the color is in the table or not.
+    def include?(color)
+      !!index(color)
+    end
+
+    # Find the index of a color of the table that is close to an arbitrary
+    # color (in Euclidean RGB distance). Colors in the table are found exactly.
+    # The rest are looked up in an RGB cube which fills up as it's used, so
+    # repeated queries (e.g. when mapping the pixels of many frames with
+    # {#map_rgb}) get cheaper.
+    # @param color [Integer] The color to match.
+    # @return [Integer] The index of the closest color to the center of the
+    #   cube cell the color falls in. The cells are 4 units wide per channel,
+    #   so this is approximate: it may not be the very closest color when
+    #   several of them are nearly as close.
+    # @raise [Exception::ColorTableError] If the table is empty.
+    # @see #index
+    def nearest(color)
+      color_map.find(color & 0xFFFFFF) # Refer to quantize.c
+    end
+
+    # Map packed RGB data to the indices of the closest colors of the table, as
+    # for {#nearest}, so that the colors not in the table are approximate.
+    # @param data [String] The colors, as a packed RGB string, 3 bytes per color.
+    # @return [String] The indices, as a binary string, 1 byte per color.
+    # @raise [Exception::ColorTableError] If the table is empty.
+    def map_rgb(data)
+      color_map.map(data) # Refer to quantize.c
+    end
+
+    # Rebuild the inverse lookup of the table (see {#auto_update}). This is only
+    # needed after modifying the {#colors} list directly.
+    # @return (see #initialize)
+    def update
+      @slots = {}
+      @free = []
+      @colors.each_with_index{ |c, i| c ? (@slots[c] ||= []) << i : @free << i }
+      @outdated = false
+      @color_map = nil
       self
     end
 
@@ -287,7 +375,8 @@ module Gifenc
     # @return [Integer] Distinct color count.
     # @see #count
     def distinct
-      @colors.uniq.count{ |c| !!c }
+      update if @outdated
+      @slots.size
     end
 
     private
@@ -297,9 +386,73 @@ module Gifenc
       @colors.rindex{ |c| !!c }
     end
 
-    # Find the first empty slot (nil if full).
-    def find_slot
-      @colors.index(nil)
+    # Perform an operation that moves colors to other indices, recording where
+    # each of them ended up (see {#mapping}). Empty slots stay in place.
+    def track
+      old = @colors.dup
+      yield
+      @mapping = old.each_with_index.map{ |c, i| c ? index(c) : i }.pack('C*')
+      self
+    end
+
+    # Find all empty slots, in order.
+    def free_slots
+      update if @outdated
+      @free
+    end
+
+    # Find all the slots containing a color, in order.
+    def slots_of(color)
+      return @colors.each_index.select{ |i| @colors[i] == color } if @outdated
+      (@slots[color] || []).dup
+    end
+
+    # Change the color of a single slot, updating the inverse lookup for that
+    # slot alone, or marking it as outdated, depending on the policy (see
+    # {#auto_update}).
+    def assign(slot, color)
+      old = @colors[slot]
+      return if old == color
+      @colors[slot] = color
+      @color_map = nil
+      return @outdated = true if !@auto_update || @outdated
+      if old
+        slots = @slots[old]
+        sorted_delete(slots, slot)
+        @slots.delete(old) if slots.empty?
+        sorted_insert(@free, slot)
+      end
+      if color
+        sorted_insert(@slots[color] ||= [], slot)
+        sorted_delete(@free, slot)
+      end
+    end
+
+    # Insert an index into a sorted list of indices.
+    def sorted_insert(list, i)
+      list.insert(list.bsearch_index{ |j| j >= i } || list.size, i)
+    end
+
+    # Remove an index from a sorted list of indices, if present.
+    def sorted_delete(list, i)
+      pos = list.bsearch_index{ |j| j >= i }
+      list.delete_at(pos) if pos && list[pos] == i
+    end
+
+    # Update the inverse lookup after a modification, or mark it as outdated,
+    # depending on the policy (see {#auto_update}).
+    def changed
+      @auto_update ? update : @outdated = true
+      self
+    end
+
+    # The native lookup used for nearest color queries, built on first use.
+    def color_map
+      update if @outdated
+      if @slots.empty?
+        raise Exception::ColorTableError, "Cannot find colors in an empty color table."
+      end
+      @color_map ||= ColorMap.new(@colors)
     end
 
   end
@@ -24,5 +24,10 @@ module Gifenc
     # Raised when a mathematic error happens in any of the calculations.
     class GeometryError < Exception
     end
+
+    # Raised when a GIF file cannot be decoded, such as when the data is not
+    # a GIF file at all.
+    class DecoderError < Exception
+    end
   end
 end
@@ -67,7 +67,7 @@ module Gifenc
     class GraphicControl < Extension
 
       # Label identifying a Graphic Control Extension block.
-      LABEL = "\xF9".freeze
+      LABEL = "\xF9".b.freeze
 
       # Specifies the time, in 1/100ths of a second, to leave this image onscreen
       # before moving on to rendering the next one in the GIF. Must be between
@@ -140,6 +140,21 @@ module Gifenc
         @trans_color  = (0..0xFF).include?(trans_color) ? trans_color : nil
       end
 
+      # Decode a Graphic Control Extension block from a GIF file.
+      # @param data [String] The GIF data.
+      # @param offset [Integer] The offset of the block (i.e., of the extension
+      #   introducer) in the data.
+      # @return [GraphicControl] The decoded extension.
+      def self.decode(data, offset)
+        flags, delay, trans_color = data.byteslice(offset + 3, 4).unpack('CS<C')
+        new(
+          delay:       delay,
+          disposal:    flags >> 2 & 0b111,
+          trans_color: flags & 0b1 == 1 ? trans_color : nil,
+          user_input:  flags >> 1 & 0b1 == 1
+        )
+      end
+
       # Encode the extension block as a 6-byte binary string, as it will appear
       # in the actual GIF file.
       # @return [String] The encoded extension block.
@@ -193,7 +208,7 @@ module Gifenc
     class Application < Extension
 
       # Label identifying an Application Extension block.
-      LABEL = "\xFF".freeze
+      LABEL = "\xFF".b.freeze
 
       # Application identifier. Must be an 8 character ASCII string.
       # @return [String] The identifier string.
@@ -224,12 +239,27 @@ module Gifenc
       # will appear in the actual GIF file.
       # @return [String] The encoded extension block.
       def body
-        # Sanitize fields
-        id   = @id.force_encoding('US-ASCII').scrub[0...8].ljust(8, "\x00")
-        code = @code[0...3].ljust(3, "\x00")
+        header + Util.blockify(data)
+      end
 
-        # Build string
-        "\x0B" + id + code + Util.blockify(data)
+      # Encode the extension and write it to a stream. The application data is
+      # written in sub-blocks directly (see {Util.write_blocks}), so that large
+      # extensions are never concatenated in memory.
+      # @param stream [IO] Stream to write the data to.
+      def encode(stream)
+        stream << EXTENSION_INTRODUCER
+        stream << @label
+        stream << header
+        Util.write_blocks(stream, data)
+      end
+
+      private
+
+      # Sanitized identifier and authentication code, preceded by their size.
+      def header
+        id   = @id.dup.force_encoding('US-ASCII').scrub[0...8].ljust(8, "\x00")
+        code = @code[0...3].ljust(3, "\x00")
+        "\x0B".b + id.b + code.b
       end
     end
 
@@ -257,6 +287,19 @@ module Gifenc
         @loops = loops.clamp(0, 2 ** 16 - 1)
       end
 
+      # Read the loop count from an Application Extension block of a GIF file,
+      # if it's a Netscape Extension.
+      # @param data [String] The GIF data.
+      # @param offset [Integer] The offset of the block (i.e., of the extension
+      #   introducer) in the data.
+      # @return [Integer,nil] The loop count, or `nil` if the block is not a
+      #   Netscape Extension.
+      def self.decode_loops(data, offset)
+        return if data.byteslice(offset + 2, 12) != "\x0BNETSCAPE2.0".b
+        return if data.byteslice(offset + 14, 2) != "\x03\x01".b
+        data.byteslice(offset + 16, 2).unpack1('S<')
+      end
+
       # Data of the actual extension as a 3-byte binary string.
       # @return [String] The raw application data.
       def data
@@ -654,6 +654,65 @@ module Gifenc
       true
     end
 
+    # Pack a list of points into a binary string of native doubles, in the form
+    # `[X0, Y0, X1, Y1, ...]`. This is the format taken by the batch methods
+    # ({translate_batch}, {transform_batch}, {bound_check_batch}) and by
+    # {Image#path}, which work on all the points at once natively, without
+    # creating a {Point} for each of them.
+    # @param points [Array,String] Either a list of points (each one a {Point}
+    #   or an `[X, Y]` pair, with `nil` for a gap), a flat list of coordinates,
+    #   or an already packed string, which is returned as is.
+    # @return [String] The packed points.
+    def self.pack_points(points)
+      return points if points.is_a?(String)
+      return points.pack('d*') if points.first.is_a?(Numeric)
+      points.flat_map{ |p|
+        next [Float::NAN, Float::NAN] if !p
+        p.is_a?(Point) ? [p.x, p.y] : p
+      }.pack('d*')
+    end
+
+    # Translate a batch of points according to a fixed vector (see {translate}).
+    # @param points [Array,String] The points, in any format accepted by
+    #   {pack_points}.
+    # @param vector [Array<Float>] The translation vector.
+    # @return [String] The translated points, packed.
+    def self.translate_batch(points, vector)
+      vector = Point.parse(vector)
+      Gifenc.points_translate(pack_points(points), vector.x, vector.y) # Refer to main.c
+    end
+
+    # Computes the coordinates of a batch of points relative to a provided bbox
+    # (see {transform}).
+    # @param points (see #translate_batch)
+    # @param bbox [Array<Integer>] The bounding box in the form `[X, Y, W, H]`.
+    # @return [String] The transformed points, packed.
+    def self.transform_batch(points, bbox)
+      translate_batch(points, [-bbox[0], -bbox[1]])
+    end
+
+    # Checks if a batch of points is entirely contained in the specified bounding
+    # box (see {bound_check}). Only their extremes are compared, so this is much
+    # faster for large amounts of points. Gaps (NaN coordinates) are ignored.
+    # @param points (see #translate_batch)
+    # @param bbox [Array<Integer>,Image] The bounding box in the form `[X, Y, W, H]`,
+    #   or an image, to use its whole area.
+    # @param silent [Boolean] Whether to raise an exception or simply return
+    #   false when the check is failed.
+    # @return [Boolean] Whether all points are contained in the bounding box or not.
+    # @raise [Exception::CanvasError] If the points are not contained in the
+    #   bounding box and `silent` has not been set.
+    def self.bound_check_batch(points, bbox, silent = false)
+      bbox = [0, 0, bbox.width, bbox.height] if bbox.is_a?(Image)
+      x0, y0, x1, y1 = Gifenc.points_bounds(pack_points(points)) # Refer to main.c
+      return true if !x0
+      if x0 >= bbox[0] && x1 <= bbox[0] + bbox[2] - 1 && y0 >= bbox[1] && y1 <= bbox[1] + bbox[3] - 1
+        return true
+      end
+      return false if silent
+      raise Exception::CanvasError, "Out of bounds pixels found, spanning (#{x0}, #{y0}) to (#{x1}, #{y1})."
+    end
+
     # Compute a linear combination of points given the weights. The two supplied
     # arrays should have the same length.
     # @param points [Array<Point>] The points to combine.
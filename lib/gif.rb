@@ -12,6 +12,22 @@ module Gifenc
     # 1-byte block indicating the termination of the GIF data stream.
     TRAILER = ';'
 
+    # Maximum amount of images that may be waiting to be compressed in the
+    # background in auto-compress mode. When exceeded, adding more images will
+    # wait, so that the raw pixel memory stays bounded.
+    AUTO_COMPRESS_BACKLOG = 4
+
+    # Maximum amount of images that may be in flight (being compressed or
+    # waiting to be written) when adding them asynchronously to an opened GIF.
+    # When exceeded, adding more images will wait (see {#open}).
+    ASYNC_BACKLOG = 8
+
+    # Maximum amount of bytes to preallocate for the output string of {#write}.
+    WRITE_CAPACITY = 16 * 1024 * 1024
+
+    # Default size of the tiles a large image is split into (see {#add_tiled}).
+    TILE_SIZE = [256, 256]
+
     # The width of the GIF's logical screen, i.e., its canvas. To resize it, use
     # the {#resize} method.
     # @return [Integer] Width of the logical screen in pixels.
@@ -83,9 +99,11 @@ module Gifenc
     # @return [Integer] Pixel aspect ratio.
     attr_accessor :ar
 
-    # The array of images present in the GIF.
+    # The array of images present in the GIF. Appending images to it with `<<`
+    # or `push` will trigger the compression of the previous one, if
+    # {#auto_compress} is enabled.
     # @return [Array<Image>] Image list.
-    attr_accessor :images
+    attr_reader :images
 
     # The array of global extensions present in the GIF. This may include
     # Application Extensions, Comment Extensions, etc. Other extensions, like
@@ -103,6 +121,91 @@ module Gifenc
     # @return [Boolean] Auto-destroy mode.
     attr_accessor :destroy
 
+    # Automatically compress each image as soon as a new one is appended to the
+    # {#images} list, in order to keep only the compressed pixels in memory. The
+    # compression happens in the background, so that it overlaps with the
+    # rendering of the following images. Images are transparently decompressed
+    # again if they are modified afterwards, and the encoding simply copies the
+    # already compressed data. Intended for long GIFs whose raw pixels would not
+    # fit comfortably in memory.
+    # @return [Boolean] Auto-compress mode.
+    attr_accessor :auto_compress
+
+    # Extension of the {#images} list that notifies the GIF whenever new
+    # images are added, so that those that are no longer the last one can be
+    # auto-compressed. This covers {#<<}, {#push}, {#insert}, {#unshift},
+    # {#concat} and {#[]=}; other ways of changing the list, like `replace`,
+    # don't auto-compress anything.
+    module ImageList
+      # @return [Gif] The GIF this list belongs to.
+      attr_accessor :gif
+
+      # Append an image to the list (see {Gif#auto_compress}).
+      # @param image [Image] The image to append.
+      # @return [Array<Image>] The list.
+      def <<(image)
+        @gif.send(:supersede, last) if @gif && !empty?
+        super
+      end
+
+      # Append several images to the list (see {Gif#auto_compress}).
+      # @param images [Array<Image>] The images to append.
+      # @return [Array<Image>] The list.
+      def push(*images)
+        images.each{ |image| self << image }
+        self
+      end
+      alias_method :append, :push
+
+      # Insert images before the given index (see {Gif#auto_compress}).
+      # @param index [Integer] Index to insert the images at.
+      # @param images [Array<Image>] The images to insert.
+      # @return [Array<Image>] The list.
+      def insert(index, *images)
+        superseding(images){ super(index, *images) }
+      end
+
+      # Prepend images to the list (see {Gif#auto_compress}).
+      # @param images [Array<Image>] The images to prepend.
+      # @return [Array<Image>] The list.
+      def unshift(*images)
+        superseding(images){ super(*images) }
+      end
+      alias_method :prepend, :unshift
+
+      # Append the images of other lists (see {Gif#auto_compress}).
+      # @param lists [Array<Array<Image>>] The lists whose images to append.
+      # @return [Array<Image>] The list.
+      def concat(*lists)
+        superseding(lists.flatten(1)){ super(*lists) }
+      end
+
+      # Set an image, or a range of them (see {Gif#auto_compress}). Takes the
+      # same arguments as `Array#[]=`.
+      # @return [Image, Array<Image>] The assigned value.
+      def []=(*args)
+        value = args.last
+        images = args.size > 2 || args[0].is_a?(Range) ? Array(value) : [value]
+        superseding(images){ super(*args) }
+      end
+
+      private
+
+      # Perform a change of the list that adds some images, and then
+      # auto-compress those of them that aren't the last one, as well as the
+      # previous last one if it's been superseded.
+      def superseding(images)
+        before = last
+        result = yield
+        if @gif
+          ([before] + images).uniq(&:object_id).each{ |image|
+            @gif.send(:supersede, image) if image.is_a?(Image) && !image.equal?(last)
+          }
+        end
+        result
+      end
+    end
+
     # Creates a new GIF object.
     # @param width       [Integer]    Width of the logical screen (canvas) in pixels (see {#width} and {#resize}).
     # @param height      [Integer]    Height of the logical screen (canvas) in pixels (see {#height} and {#resize}).
@@ -115,6 +218,7 @@ module Gifenc
     # @param bg          [Integer]    Background color (see {#bg}).
     # @param ar          [Integer]    Pixel aspect ratio (see {#ar}).
     # @param destroy     [Boolean]    Auto-destroy each image right after encoding (see {#destroy}).
+    # @param auto_compress [Boolean]  Compress each image once the next one is added (see {#auto_compress}).
     # @return [Gif] The GIF object.
     def initialize(
         width,
@@ -128,7 +232,8 @@ module Gifenc
         loops:       DEFAULT_LOOPS,
         bg:          DEFAULT_BACKGROUND,
         ar:          DEFAULT_ASPECT_RATIO,
-        destroy:     false
+        destroy:     false,
+        auto_compress: false
       )
       # GIF attributes
       @width  = width
@@ -145,33 +250,146 @@ module Gifenc
       @disposal    = disposal
 
       # GIF content data
-      @images     = []
+      self.images = []
       @extensions = []
 
       # Other
       @destroy = destroy
+      @auto_compress = auto_compress
       @file = nil
 
+      # Background compression
+      @compress_lock = Mutex.new
+      @compress_jobs = []
+      @compress_done = Queue.new
+      @compressing   = false
+      @compress_pending = 0
+
       # If we want the GIF to loop, then add the Netscape Extension
       self.loops = loops
     end
 
+    # Decode a GIF from its binary data. The block structure is scanned natively
+    # in a single pass, but the image data is not decompressed yet: each image
+    # keeps its LZW data, which is decoded whenever its pixels are read, and
+    # only dropped once the image is modified (see {Image#pixels}). Re-encoding
+    # an untouched image thus simply copies its data.
+    # @param data [String] The GIF data.
+    # @return [Gif] The decoded GIF.
+    # @note Only the Graphic Control Extension and the Netscape Extension are
+    #   decoded, all other extensions (comments, plain text, etc) are skipped.
+    # @raise [Exception::DecoderError] If the data is not a valid GIF.
+    # @see .load
+    def self.read(data)
+      data = data.b
+      from_index(Gifenc.gif_index(data), ->(offset, length){ data.byteslice(offset, length) }){ |offset, length|
+        { lzw: data.byteslice(offset, length) }
+      }
+    end
+
+    # Decode a GIF file from disk. Unlike {.read}, the file is not read into
+    # memory: it's mapped instead (see {Reader}), and indexed in a single pass.
+    # Each image then only holds the location of its data, and will only read
+    # and decode it when its pixels are first accessed, so that opening even
+    # huge files is quick and cheap, and any frame can be accessed directly.
+    # @param filename [String] Name of the GIF file.
+    # @return (see .read)
+    # @note The file remains mapped until all its images have been decompressed
+    #   or discarded, so it shouldn't be modified in the meantime.
+    # @raise (see .read)
+    def self.load(filename)
+      reader = Reader.new(filename)
+      from_index(reader.index, reader.method(:read)){ |offset, length|
+        { source: [reader, offset, length] }
+      }
+    end
+
+    # Build a GIF from the block index of a file (as returned by `Gifenc.gif_index`).
+    # @param index [Array] The index of the GIF file.
+    # @param read [Proc] Reads a range of bytes of the file.
+    # @yield [offset, length] Location of the compressed data of each image.
+    # @yieldreturn [Hash] The keywords to pass the image to refer to its data.
+    # @return (see .read)
+    private_class_method def self.from_index(index, read)
+      width, height, flags, bg, ar, gct, images, extensions = index
+
+      loops = 0
+      extensions.each{ |label, offset, last|
+        next if label != 0xFF
+        count = Extension::Netscape.decode_loops(read.(offset, last - offset), 0)
+        loops = count == 0 ? -1 : count if count
+      }
+
+      if gct
+        bits = (flags & 0b111) + 1
+        gct = ColorTable.decode(read.(gct, 3 * 2 ** bits), 0, bits,
+          depth: (flags >> 4 & 0b111) + 1, sorted: flags & 0x08 != 0)
+      end
+      gif = new(width, height, gct: gct, bg: bg, ar: ar, loops: loops)
+
+      images.each{ |gce, x, y, w, h, img_flags, lct, offset, last|
+        if lct
+          bits = (img_flags & 0b111) + 1
+          lct = ColorTable.decode(read.(lct, 3 * 2 ** bits), 0, bits, sorted: img_flags & 0x20 != 0)
+        end
+        gif.images << Image.new(w, h, x, y,
+          gce:       gce && Extension::GraphicControl.decode(read.(gce, 8), 0),
+          interlace: img_flags & 0x40 != 0,
+          lct:       lct,
+          **yield(offset, last - offset)
+        )
+      }
+
+      gif
+    end
+
     # Encode all the data as a GIF file and write it to a stream.
     # @param stream [IO] Stream to write the data to.
-    def encode(stream)
+    # @param threads [Integer] Amount of threads to use for compressing the
+    #   images. If more than 1, the images will be LZW-compressed concurrently
+    #   on a pool of worker threads, and still written to the stream in their
+    #   original order.
+    # @param crop [Boolean] Crop each image to its {Image#dirty} region, thus
+    #   only encoding what has been drawn on it since it was last cleaned, and
+    #   leaving the rest of the previous frame onscreen. Use this when each
+    #   frame is a copy of the previous one with some changes on top, and the
+    #   previous frame isn't disposed of (see {Image#encode}).
+    # @param dedup [Boolean] Drop every image that is identical to the previous
+    #   one, except for its delay, adding that delay to the kept image instead.
+    #   The result looks exactly the same, but repeated frames (e.g. a paused
+    #   animation) are only encoded once. The images themselves aren't changed.
+    # @param strategy [Symbol] LZW compression strategy, `:standard`, `:deferred`
+    #   or `:fast` (see {Image#encode}). Images that are already compressed,
+    #   such as those of auto-compress mode, keep their data.
+    # @yield [stats] If a block is given, or a global hook has been set (see
+    #   {Gifenc.stats_hook}), statistics are collected for every frame and
+    #   passed to both of them once it's been written. Otherwise, nothing is
+    #   measured at all.
+    # @yieldparam stats [Hash] The statistics of the frame, which are those of
+    #   {Image#encode}, plus the index of the image (`:frame`) and the amount
+    #   of repeated images merged into it (`:merged`, see `dedup`).
+    def encode(stream, threads: 1, crop: false, dedup: false, strategy: :standard, &block)
+      finish_compression
       encode_head(stream)
 
-      @images.size.times.each{ |i|
-        @images[i].encode(stream)
-        if @destroy
-          @images[i].destroy
-          @images[i] = nil
-        end
-      }
+      report = stats_report(block)
+      frames = frame_list(crop, dedup)
+      if threads > 1 && frames.size > 1
+        encode_parallel(stream, frames, threads, crop, strategy, report)
+      else
+        frames.each{ |frame| encode_frame(stream, frame, crop: crop, strategy: strategy, report: report) }
+      end
 
       encode_tail(stream)
     end
 
+    # Replace the list of images of the GIF.
+    # @param images [Array<Image>] The new image list.
+    def images=(images)
+      @images = images.extend(ImageList)
+      @images.gif = self
+    end
+
     # Change the dimensions of the GIF's logical screen, i.e, its canvas.
     # @param width [Integer] The new width of the GIF, in pixels.
     # @param height [Integer] The new height of the GIF, in pixels.
@@ -185,15 +403,27 @@ module Gifenc
       self
     end
 
+    # Scale the whole GIF by the given factors using nearest neighbour sampling.
+    # The logical screen is scaled, as well as all of the images, so that they
+    # still line up (see {Image#scale}).
+    # @param fx [Float] Horizontal scaling factor.
+    # @param fy [Float] Vertical scaling factor. Defaults to the horizontal one.
+    # @return (see #initialize)
+    def scale(fx, fy = fx)
+      finish_compression
+      @images.each{ |img| img.scale(fx, fy) }
+      @width  = [(@width  * fx).round, 1].max
+      @height = [(@height * fy).round, 1].max
+      self
+    end
+
     # Overload for the loop count so that we can appropriately create or delete
     # the required Netscape Extension.
     def loops=(value)
       raise Exception::GifError, "Loop count must be between -1 and 65535" if !value.between?(-1, 65535)
-      if value == 0
-        @extensions.reject!{ |e| e.is_a?(Extension::Netscape) }
-      else
-        @extensions << Extension::Netscape.new(value == -1 ? 0 : value)
-      end
+      @extensions.reject!{ |e| e.is_a?(Extension::Netscape) }
+      @extensions << Extension::Netscape.new(value == -1 ? 0 : value) if value != 0
+      @loops = value
     end
 
     # Shortcut to not loop the GIF at all. This sets the loop count to 0 and
@@ -246,20 +476,179 @@ module Gifenc
       self
     end
 
+    # Optimize the GIF by removing the redundancy between consecutive frames.
+    # Each frame is compared with what would be onscreen before it is drawn, and
+    # cropped to the bounding box of the pixels that actually change, while the
+    # unchanged pixels within it are made transparent, which compresses much
+    # better. The previous frame is set not to be disposed of, so that the
+    # result looks exactly the same. Frames that typically differ only in a
+    # small region, like the hands of a clock, become an order of magnitude
+    # smaller and faster to encode.
+    #
+    # Frames only get optimized when the canvas before them is fully known and
+    # is kept by the previous frame. Thus, those with a Local Color Table, those
+    # following a frame that is disposed of ({DISPOSAL_BG} or {DISPOSAL_PREV}),
+    # and those restored to the background themselves, are left untouched.
+    # Disposal method 0 is taken to keep the frame onscreen, like virtually all
+    # decoders do.
+    # @param dirty [Boolean] Trust the {Image#dirty} rectangle of each frame to
+    #   contain all of its differences with the previous one, so that only that
+    #   region needs to be compared. Frames without a dirty rectangle are still
+    #   compared fully.
+    # @note The images of the GIF are modified (and decompressed if necessary),
+    #   so call this once all of them are finished.
+    # @return (see #initialize)
+    def optimize!(dirty: false)
+      colors = @gct ? @gct.size : 256
+      prev = nil    # Previous frame
+      base = nil    # Canvas before the previous frame, if known
+      screen = nil  # Canvas after the previous frame, if known
+
+      @images.each{ |image|
+        # Canvas onscreen before this frame, after disposing of the previous one
+        kept = prev && [nil, DISPOSAL_REPLACE, DISPOSAL_NONE].include?(prev.disposal)
+        before = kept ? screen : prev&.disposal == DISPOSAL_PREV ? base : nil
+        after = composite(before, image)
+
+        # Replace the frame by its difference with the previous canvas
+        optimizable = [nil, DISPOSAL_REPLACE, DISPOSAL_NONE, DISPOSAL_PREV].include?(image.disposal)
+        if kept && before && after && optimizable
+          region = dirty ? image.dirty : nil
+          region = [image.x + region[0], image.y + region[1], region[2], region[3]] if region
+          diff = Gifenc.frame_diff(before, after, @width, @height, image.trans_color || @trans_color, colors, region)
+          x, y, w, h, trans, pixels = diff || [0, 0, 1, 1, nil, after.byteslice(0, 1)]
+          image.replace(pixels, bbox: [x, y, w, h])
+          image.trans_color = trans
+          prev.disposal = DISPOSAL_NONE
+        end
+
+        prev, base, screen = image, before, after
+      }
+
+      self
+    end
+
+    # Replace the color tables of all the frames by a single global one. The
+    # colors actually used by each frame are counted, the histograms are merged,
+    # and a palette is fitted to them (see {Canvas#quantize}). Every frame is then
+    # remapped to its closest colors in the new table, and loses its LCT. This
+    # makes the file smaller, and allows frames to be optimized against each
+    # other (see {#optimize!}). If any frame uses transparency, or the GIF has a
+    # default {#trans_color}, the last slot of the table is reserved for it, and
+    # every transparent color is moved there. The {#bg} color is moved to its
+    # closest color in the new table.
+    # @param colors [Integer] Maximum amount of colors for the new table.
+    # @param stride [Integer] Only sample one every `stride` pixels of each frame
+    #   when counting colors. Larger values are faster, but rare colors may be
+    #   missed.
+    # @param threads [Integer] Amount of threads to sample the frames with. Each
+    #   thread builds its own histogram, and they're merged at the end.
+    # @return (see #initialize)
+    # @raise [Exception::GifError] If there are no frames in the GIF yet, if
+    #   any of them has no color table at all, or if the amount of colors isn't
+    #   valid (at least 1, or 2 when a slot is reserved for transparency, and at
+    #   most 256).
+    def build_global_palette(colors: ColorTable::MAX_SIZE, stride: 1, threads: 1)
+      raise Exception::GifError, "No frames in the GIF yet." if @images.empty?
+      if @images.any?{ |img| !img.lct && !@gct }
+        raise Exception::GifError, "Cannot build a palette for frames without a color table."
+      end
+      trans = @trans_color || @images.any?(&:trans_color)
+      min = trans ? 2 : 1
+      if !colors.is_a?(Integer) || !colors.between?(min, ColorTable::MAX_SIZE)
+        raise Exception::GifError, "The palette must have between #{min} and #{ColorTable::MAX_SIZE} colors."
+      end
+      finish_compression
+      gct = @gct
+
+      # Sample the colors of the frames, each thread taking every n-th frame
+      count = [[threads, @images.size].min, 1].max
+      histograms = count.times.map{ |t|
+        Thread.new{
+          hist = Hash.new(0)
+          (t ... @images.size).step(count).each{ |i|
+            img = @images[i]
+            table = (img.lct || gct).colors
+            counts = Gifenc.index_histogram(img.pixels, stride) # Refer to quantize.c
+            counts.each_with_index{ |n, c|
+              hist[table[c] || 0] += n if n > 0 && c != img.trans_color
+            }
+          }
+          hist
+        }
+      }.map(&:value)
+      hist = histograms.reduce{ |a, b| a.merge!(b){ |_, x, y| x + y } }
+
+      # Fit the new table, reserving a slot for transparency if needed
+      max = trans ? colors - 1 : colors
+      palette = hist.empty? ? [0] : Gifenc.rgb_quantize(Gifenc.rgb_pack(hist.keys), max, hist.values.pack('Q*'))
+      @gct = ColorTable.new(trans ? palette + [0] : palette)
+      slot = palette.size
+
+      # Remap every frame to the new table
+      @images.each{ |img|
+        table = (img.lct || gct).colors.map{ |c| c || 0 }
+        lut = Gifenc.rgb_map(Gifenc.rgb_pack(table), palette) # Refer to quantize.c
+        lut.setbyte(img.trans_color, slot) if img.trans_color
+        img.remap(lut.ljust(256, "\x00"))
+        img.lct = nil
+      }
+
+      # Move the GIF's own colors, which referred to the old global table
+      if gct && @bg && @bg < gct.size
+        @bg = Gifenc.rgb_map(Gifenc.rgb_pack([gct.colors[@bg] || 0]), palette).getbyte(0)
+      end
+      @trans_color = slot if @trans_color
+
+      self
+    end
+
+    # Change the color indices of all the images according to a lookup table
+    # (see {Image#remap}), as well as the default transparent and background
+    # colors of the GIF. Typically used after modifying the global color table
+    # in ways that move colors to other indices (see {ColorTable#mapping}).
+    # @param mapping [String, Array<Integer>, Hash] The new index of each color
+    #   index, in any of the formats supported by {Util.lut}.
+    # @param local [Boolean] Whether to also remap the images that have a local
+    #   color table, which normally don't use the global one.
+    # @return (see #initialize)
+    # @raise [Exception::ColorTableError] If the mapping isn't valid.
+    def remap(mapping, local: false)
+      lut = Util.lut(mapping)
+      finish_compression
+      @images.each{ |img| img.remap(lut) if local || !img.lct }
+      @trans_color = lut.getbyte(@trans_color) if @trans_color
+      @bg = lut.getbyte(@bg) if @bg
+      self
+    end
+
     # Encode and write the GIF to a string.
+    # @param threads [Integer] Amount of threads to use for compressing the
+    #   images (see {#encode}).
+    # @param crop [Boolean] Crop images to their dirty region (see {#encode}).
+    # @param dedup [Boolean] Merge repeated images (see {#encode}).
+    # @param strategy [Symbol] LZW compression strategy (see {#encode}).
+    # @yield (see #encode)
+    # @yieldparam (see #encode)
     # @return [String] The string containing the encoded GIF file.
-    def write
-      str = StringIO.new
-      str.set_encoding("ASCII-8BIT")
-      encode(str)
-      str.string
+    def write(threads: 1, crop: false, dedup: false, strategy: :standard, &block)
+      str = String.new(capacity: encoded_size, encoding: Encoding::BINARY)
+      encode(str, threads: threads, crop: crop, dedup: dedup, strategy: strategy, &block)
+      str
     end
 
     # Encode and write the GIF to a file.
     # @param filename [String] Name of the output file.
-    def save(filename)
+    # @param threads [Integer] Amount of threads to use for compressing the
+    #   images (see {#encode}).
+    # @param crop [Boolean] Crop images to their dirty region (see {#encode}).
+    # @param dedup [Boolean] Merge repeated images (see {#encode}).
+    # @param strategy [Symbol] LZW compression strategy (see {#encode}).
+    # @yield (see #encode)
+    # @yieldparam (see #encode)
+    def save(filename, threads: 1, crop: false, dedup: false, strategy: :standard, &block)
       File.open(filename, 'wb') do |f|
-        encode(f)
+        encode(f, threads: threads, crop: crop, dedup: dedup, strategy: strategy, &block)
       end
     end
 
@@ -272,27 +661,41 @@ module Gifenc
     # images, and finally {#close} it. Intended to reduce memory footprint, specially
     # useful for GIFs with thousands of frames on systems with low memory.
     # @param filename [String] The name to use for the GIF file.
+    # @param threads [Integer] Amount of background threads to compress the
+    #   images with. If 0 (default), {#add} compresses and writes each image
+    #   right away. Otherwise, it only queues a copy of the image, which is
+    #   compressed by any of these threads and then written to disk in order by
+    #   yet another one, so that the caller can go on rendering meanwhile.
+    # @param backlog [Integer] Maximum amount of images in flight when adding
+    #   them asynchronously. Once reached, {#add} waits for the oldest one to be
+    #   written, so that memory stays bounded.
     # @see #close
     # @see #add
     # @raise [Exception::GifError] If the GIF has already been opened.
-    def open(filename)
+    def open(filename, threads: 0, backlog: ASYNC_BACKLOG)
       raise Exception::GifError, "The GIF has already been opened." if open?
       @file = File.open(filename, "wb")
       encode_head(@file)
+      start_pipeline(threads, backlog) if threads > 0
     end
 
     # Finish writing the GIF to disk and close it. This writes the trailer to the
     # file and immediately closes it. Only use this when the GIF has been previously
     # opened with {#open}, intended for dynamically creating a GIF and writing
     # it to disk on the fly. To keep everything in memory and just export at the
-    # the end, use {#write} or {#save} instead.
+    # the end, use {#write} or {#save} instead. When adding images
+    # asynchronously, this first waits for all of them to be written.
     # @see #open
     # @see #add
     # @raise [Exception::GifError] If the GIF had not been opened.
+    # @raise [StandardError] Any error found while asynchronously compressing or
+    #   writing the images.
     def close
       raise Exception::GifError, "The GIF hasn't been opened." if !open?
+      finish_pipeline if @async_writer
       encode_tail(@file)
-      @file.close
+    ensure
+      @file.close if open?
     end
 
     # Add an image to the GIF and write to disk now. Only use this if the GIF
@@ -301,10 +704,65 @@ module Gifenc
     # list and call {#write} or {#save} at the end, which doesn't require to open
     # or close the GIF.
     # @param image [Image] The image to add to the file stream.
+    # @param crop [Boolean] Crop the image to its dirty region (see {#encode}).
+    # @param strategy [Symbol] LZW compression strategy (see {#encode}).
+    # @note When adding images asynchronously (see {#open}), a copy of the image
+    #   is queued instead. The copy shares the pixels until either of them is
+    #   modified, so the image may be safely reused for the next frame.
     # @raise [Exception::GifError] If the GIF had not been opened.
-    def add(image)
+    # @raise [StandardError] Any error found while asynchronously compressing or
+    #   writing the previous images.
+    def add(image, crop: false, strategy: :standard)
       raise Exception::GifError, "The GIF hasn't been opened." if !open?
-      image.encode(@file)
+      return image.encode(@file, gct: @gct, crop: crop, strategy: strategy) if !@async_writer
+      raise @async_error if @async_error
+      @async_slots << true
+      @async_jobs << [@async_count, image.dup, crop, strategy]
+      @async_count += 1
+    end
+
+    # Add a large still image split into tiles, each of them a separate frame
+    # placed at its position in the logical screen, with no delay in between.
+    # A single image is a single LZW stream, which can only be compressed by
+    # one thread, whereas the tiles are compressed independently, so they're
+    # compressed concurrently when encoding with several threads (see
+    # {#encode}), or when adding them asynchronously to an opened GIF (see
+    # {#open}). The tiles are appended to the {#images}, or added to the file
+    # if the GIF has been opened.
+    #
+    # A truecolor {Canvas} may be given instead, in which case each tile is
+    # fitted to its own local color table, so that the whole image may show
+    # many more than 256 colors.
+    # @note While the tiles are drawn on top of each other without delay, some
+    #   viewers enforce a minimum one, and thus show the image being built.
+    # @param image [Image, Canvas] The image to split, whose tiles are copied.
+    #   The tiles of an {Image} keep its color table and transparent color.
+    # @param tile [Array<Integer>] The size of the tiles, as `[W, H]`. The ones
+    #   at the right and bottom edges may be smaller.
+    # @param delay [Integer] Time to display the whole image, i.e., the delay
+    #   of the last tile. Defaults to the delay of the image.
+    # @param options [Hash] Options to convert each tile of a canvas to an image
+    #   (see {Canvas#to_image}), such as the amount of colors or the dithering.
+    # @return [Array<Image>] The tiles.
+    # @raise [Exception::GifError] If the tile size isn't valid.
+    def add_tiled(image, tile: TILE_SIZE, delay: nil, **options)
+      tw, th = tile
+      if !tw.is_a?(Integer) || !th.is_a?(Integer) || tw < 1 || th < 1
+        raise Exception::GifError, "Tiles must have a positive integer size."
+      end
+
+      canvas = image.is_a?(Canvas)
+      delay ||= image.delay if !canvas
+      tiles = (0 ... image.height).step(th).flat_map{ |y|
+        (0 ... image.width).step(tw).map{ |x|
+          w, h = [tw, image.width - x].min, [th, image.height - y].min
+          canvas ? canvas_tile(image, x, y, w, h, options) : image_tile(image, x, y, w, h)
+        }
+      }
+      tiles.last.delay = delay if delay && !tiles.empty?
+
+      open? ? tiles.each{ |t| add(t) } : @images.push(*tiles)
+      tiles
     end
 
     # Checks whether the GIF file has been opened and initialized already or not.
@@ -315,25 +773,166 @@ module Gifenc
 
     private
 
+    # Called when a new image is appended after this one. In auto-compress mode,
+    # a snapshot of its pixels is queued to be compressed by a background thread,
+    # which runs while there's work pending. The result is only adopted later,
+    # and only if the image hasn't been modified since (see {Image#adopt_lzw}).
+    def supersede(image)
+      return if !@auto_compress || image.compressed?
+      @compress_lock.synchronize{
+        @compress_jobs << [image, image.pixels.dup, image.lzw_options(@gct)]
+        @compress_pending += 1
+        next if @compressing
+        @compressing = true
+        Thread.new{ compress_worker }
+      }
+      adopt_compressed(AUTO_COMPRESS_BACKLOG)
+    end
+
+    # Body of the background compression thread. Errors are handed over to the
+    # main thread, to be raised when the result is adopted.
+    def compress_worker
+      encoder = LZWEncoder.new
+      loop do
+        image, pixels, options = @compress_lock.synchronize{
+          @compressing = false if @compress_jobs.empty?
+          @compress_jobs.shift
+        }
+        break if !image
+        lzw = begin
+          encoder.encode(pixels, **options)
+        rescue => e
+          e
+        end
+        @compress_done << [image, pixels, lzw]
+      end
+    end
+
+    # Replace the pixels of the images that have been compressed in the
+    # background with the compressed data, waiting until at most `backlog`
+    # images remain pending.
+    def adopt_compressed(backlog)
+      while @compress_pending > backlog || !@compress_done.empty?
+        image, pixels, lzw = @compress_done.pop
+        @compress_pending -= 1
+        raise lzw if lzw.is_a?(::Exception)
+        image.adopt_lzw(pixels, lzw)
+      end
+    end
+
+    # Start the threads that asynchronously compress the images added to an
+    # opened GIF, and the one that writes them to the file in order. Each
+    # image takes a slot until it's written, thus bounding the ones in flight.
+    def start_pipeline(threads, backlog)
+      @async_jobs    = Queue.new
+      @async_done    = Queue.new
+      @async_slots   = SizedQueue.new(backlog)
+      @async_count   = 0
+      @async_error   = nil
+      @async_workers = threads.times.map{ Thread.new{ async_worker } }
+      @async_writer  = Thread.new{ async_writer }
+    end
+
+    # Body of the asynchronous compression threads. Errors are handed over to
+    # the writer, like the results.
+    def async_worker
+      encoder = LZWEncoder.new
+      while (job = @async_jobs.pop)
+        i, image, crop, strategy = job
+        lzw = begin
+          image.lzw_data(encoder: encoder, gct: @gct, crop: crop, strategy: strategy)
+        rescue => e
+          e
+        end
+        @async_done << [i, image, crop, lzw]
+      end
+    end
+
+    # Body of the asynchronous writer thread, which writes each image as soon
+    # as all the previous ones have been written. After the first error, the
+    # remaining images are discarded, and the error raised by {#add} or {#close}.
+    def async_writer
+      pending = {}
+      n = 0
+      while (result = @async_done.pop)
+        pending[result[0]] = result
+        while (job = pending.delete(n))
+          _, image, crop, lzw = job
+          begin
+            raise lzw if lzw.is_a?(::Exception)
+            image.encode(@file, lzw: lzw, crop: crop) if !@async_error
+          rescue => e
+            @async_error = e
+          end
+          n += 1
+          @async_slots.pop
+        end
+      end
+    end
+
+    # Wait for all the asynchronously added images to be written, and stop the
+    # threads.
+    def finish_pipeline
+      @async_jobs.close
+      @async_workers.each(&:join)
+      @async_done.close
+      @async_writer.join
+      error = @async_error
+      @async_jobs = @async_done = @async_slots = @async_workers = @async_writer = @async_error = nil
+      raise error if error
+    end
+
+    # Compute the canvas after drawing an image on top of another one, or `nil`
+    # if it can't be known (see {#optimize!}).
+    def composite(canvas, image)
+      return if image.lct
+      full = image.bbox == [0, 0, @width, @height]
+      return image.pixels.dup if full && !image.trans_color
+      return if !canvas
+      canvas = canvas.dup
+      Gifenc.frame_composite(canvas, @width, @height, image.pixels, *image.bbox, image.trans_color)
+    end
+
+    # Wait for all the pending background compressions to finish.
+    def finish_compression
+      adopt_compressed(0)
+    end
+
     # Encode the header, logical screen descriptor, global color table, and
     # global extensions present in the GIF. In other words, encode everything
     # that comes before the actual image data.
     def encode_head(stream)
+      buffer = String.new(capacity: head_size, encoding: Encoding::BINARY)
+
       # Header
-      stream << HEADER
+      buffer << HEADER
 
       # Logical Screen Descriptor
-      stream << [@width, @height].pack('S<2')
       flags = 0
       flags |= @gct.global_flags if @gct
-      stream << [flags].pack('C')
-      stream << [@bg, @ar].pack('C2')
+      buffer << [@width, @height, flags, @bg, @ar].pack('S<2C3')
 
       # Global Color Table
-      @gct.encode(stream) if @gct
+      @gct.encode(buffer) if @gct
 
       # Global extensions
-      @extensions.each{ |e| e.encode(stream) }
+      @extensions.each{ |e| e.encode(buffer) }
+      stream << buffer
+    end
+
+    # Size of everything that precedes the image data, or at least a good
+    # estimate, since extensions are assumed to be small.
+    def head_size
+      13 + (@gct ? 3 * @gct.size : 0) + 32 * @extensions.size
+    end
+
+    # Estimate the size of the whole encoded GIF, in order to preallocate the
+    # output string. Only the data known beforehand is counted (see
+    # {Image#encoded_size}), and at most WRITE_CAPACITY bytes are reserved
+    # in any case, so that the string grows as needed beyond that.
+    def encoded_size
+      size = head_size + @images.sum{ |img| img ? img.encoded_size : 0 } + TRAILER.bytesize
+      [size, WRITE_CAPACITY].min
     end
 
     # Encode the trailer. In other words, encode everything that comes after the
@@ -342,5 +941,124 @@ module Gifenc
       # Trailer
       stream << TRAILER
     end
+
+    # Encode all images, compressing them concurrently on a pool of worker
+    # threads, each with its own LZW encoder. The compression happens without
+    # holding the GVL, so it truly runs in parallel. The main thread collects
+    # the results and writes each image as soon as all the previous ones have
+    # been written, thus preserving the original order.
+    def encode_parallel(stream, frames, threads, crop, strategy, report)
+      queue = Queue.new
+      frames.each{ |i, _| queue << i }
+      queue.close
+      results = Queue.new
+
+      workers = [threads, frames.size].min.times.map{
+        Thread.new{
+          encoder = LZWEncoder.new
+          while (i = queue.pop)
+            begin
+              stats = report && { frame: i }
+              results << [i, [@images[i].lzw_data(encoder: encoder, gct: @gct, crop: crop, strategy: strategy, stats: stats), stats]]
+            rescue => e
+              results << [i, e]
+            end
+          end
+        }
+      }
+
+      pending = {}
+      frames.each{ |frame|
+        i = frame[0]
+        pending.store(*results.pop) until pending.key?(i)
+        result = pending.delete(i)
+        raise result if result.is_a?(::Exception)
+        lzw, stats = result
+        encode_frame(stream, frame, lzw: lzw, crop: crop, stats: stats, report: report)
+      }
+    ensure
+      queue.clear if queue
+      workers.each(&:join) if workers
+    end
+
+    # List the images to encode, as triplets with the index of the image, the
+    # delay to encode it with (`nil` to keep its own), and the indices of the
+    # repeated images that were merged into it (see {#encode}). Consecutive
+    # images are only compared in full if their signatures hash the same.
+    def frame_list(crop, dedup)
+      return @images.each_index.map{ |i| [i, nil, []] } if !dedup
+      frames, last, hash = [], nil, nil
+      @images.each_with_index{ |img, i|
+        sig = img.signature(crop: crop)
+        h = sig.hash
+        if (frame = frames.last) && hash == h && last == sig
+          delay = (frame[1] || @images[frame[0]].delay.to_i) + img.delay.to_i
+          if delay <= 0xFFFF
+            frame[1] = delay if img.delay.to_i > 0
+            frame[2] << i
+            next
+          end
+        end
+        frames << [i, nil, []]
+        last, hash = sig, h
+      }
+      frames
+    end
+
+    # Encode an image as a frame from {#frame_list}, temporarily switching its
+    # delay to that of the repeated images merged into it, if any. Its
+    # statistics are collected and reported if there's anything to report to.
+    def encode_frame(stream, frame, lzw: nil, crop: false, strategy: :standard, stats: nil, report: nil)
+      i, delay, merged = frame
+      image = @images[i]
+      stats ||= report && { frame: i }
+      old, image.delay = image.delay, delay if delay
+      begin
+        image.encode(stream, lzw: lzw, gct: @gct, crop: crop, strategy: strategy, stats: stats)
+      ensure
+        image.delay = old if delay
+      end
+      if report
+        stats[:merged] = merged.size
+        report.call(stats)
+      end
+      destroy_image(i)
+      merged.each{ |j| destroy_image(j) }
+    end
+
+    # Copy a tile of an image for {#add_tiled}, as a frame without delay.
+    def image_tile(image, x, y, w, h)
+      Image.new(
+        w, h, image.x + x, image.y + y,
+        color:       image.color,
+        delay:       0,
+        disposal:    DISPOSAL_NONE,
+        trans_color: image.trans_color,
+        lct:         image.lct
+      ).copy(src: image, offset: [x, y], dim: [w, h])
+    end
+
+    # Fit a tile of a canvas to its own color table for {#add_tiled}, as a
+    # frame without delay.
+    def canvas_tile(canvas, x, y, w, h, options)
+      rgb = h.times.map{ |r| canvas.data.byteslice(3 * ((y + r) * canvas.width + x), 3 * w) }.join
+      Canvas.new(w, h, data: rgb).to_image(bbox: [x, y, w, h], delay: 0, disposal: DISPOSAL_NONE, **options)
+    end
+
+    # Combine the block given to {#encode} with the global statistics hook,
+    # returning whatever should receive the statistics of each frame, if any.
+    def stats_report(block)
+      hook = Gifenc.stats_hook
+      return block if !hook
+      return hook if !block
+      ->(stats){ block.call(stats); hook.call(stats) }
+    end
+
+    # Destroy an image after encoding it, if auto-destroy mode is enabled.
+    def destroy_image(i)
+      return if !@destroy
+      @images[i].destroy
+      @images[i] = nil
+    end
   end
 end
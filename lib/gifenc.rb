@@ -1,4 +1,5 @@
 require 'pry-byebug'
+require 'etc'
 
 # Gifenc is a pure Ruby library to encode, decode and edit GIF files. It aims
 # to eventually support the complete {file:docs/Specification.md specification}.
@@ -54,6 +55,14 @@ module Gifenc
 
   # Default time to exhibit GIF's last frame when selected (in 1/100ths of sec)
   DEFAULT_EXHIBIT_TIME = 100
+
+  class << self
+    # A global hook to collect encoding statistics, e.g. to aggregate them into
+    # some metrics. If set, it's called with the statistics of every frame
+    # encoded by {Gif#encode}, {Gif#write} or {Gif#save} (see {Gif#encode}).
+    # @return [#call, nil] The hook, `nil` (default) to collect nothing.
+    attr_accessor :stats_hook
+  end
 end
 
 require_relative 'errors.rb'
@@ -62,6 +71,7 @@ require_relative 'geometry.rb'
 require_relative 'color_table.rb'
 require_relative 'extensions.rb'
 require_relative 'image.rb'
+require_relative 'canvas.rb'
 require_relative 'gif.rb'
 
 require_relative 'cgifenc'
\ No newline at end of file
@@ -14,6 +14,21 @@ module Gifenc
     # # 1-byte field indicating the beginning of an image block.
     IMAGE_SEPARATOR = ','.freeze
 
+    # Amount of blank pixel buffers to keep around, so that new images of the
+    # same size and color can share one instead of allocating their own. The
+    # buffer is only copied once the image is drawn on.
+    BLANK_POOL_SIZE = 16
+    @blank_pool = {}
+
+    # The pixels last decoded from a compressed image without decompressing it,
+    # along with the compressed data they came from (see {#pixels}).
+    @decoded = nil
+
+    class << self
+      # @api private
+      attr_accessor :decoded
+    end
+
     # Width of the image in pixels. Use the {#resize} method to change it.
     # @return [Integer] Image width.
     # @see #resize
@@ -50,10 +65,17 @@ module Gifenc
     attr_accessor :lct
 
     # Contains the table based image data (the color indexes for each pixel).
-    # Use the {#replace} method to bulk change the pixel data.
+    # Use the {#replace} method to bulk change the pixel data. If the image is
+    # compressed (e.g. it was just decoded from a file), this is a decoded copy,
+    # and the image stays compressed, so that reading the frames of a large
+    # GIF doesn't make them all resident. The last frame decoded this way is
+    # kept, so repeated reads of the same frame only decode it once. It's only
+    # decompressed for good when it's modified.
     # @return [String] Pixel data as a binary string.
     # @see #replace
-    attr_reader :pixels
+    def pixels
+      @compressed ? decoded_pixels.dup : @pixels
+    end
 
     # Create a new image or frame. The minimum information required is the
     # width and height, which may be supplied directly, or by providing the
@@ -88,6 +110,13 @@ module Gifenc
     #   interlaced or not.
     # @param lct [ColorTable] Add a Local Color Table to this image, overriding
     #   the global one.
+    # @param lzw [String] Initialize the image with already LZW-compressed pixel
+    #   data (as returned by {#lzw_data}), instead of a blank canvas. The image
+    #   will then start compressed, and will only be decompressed when its pixels
+    #   are first accessed. Mostly used when decoding GIF files.
+    # @param source [Array] Like `lzw`, but the compressed data is instead left
+    #   in a file opened by a {Reader}, given as `[reader, offset, length]`. It
+    #   will only be read when needed (used by {Gif.load}).
     # @return [Image] The image.
     def initialize(
         width      = nil,
@@ -101,7 +130,9 @@ module Gifenc
         trans_color: nil,
         disposal:    nil,
         interlace:   DEFAULT_INTERLACE,
-        lct:         nil
+        lct:         nil,
+        lzw:         nil,
+        source:      nil
       )
       # Image attributes
       if bbox
@@ -116,7 +147,9 @@ module Gifenc
       @y          = y      if y
       @lct        = lct
       @interlace  = interlace
-      @compressed = false
+      @source     = source
+      @compressed = !!(lzw || source)
+      @dirty      = nil
 
       # Checks
       raise Exception::CanvasError, "The width of the image must be supplied" if !@width
@@ -126,7 +159,8 @@ module Gifenc
 
       # Image data
       @color  = color
-      @pixels = (@color.chr * (@width * @height)).b
+      @pixels = lzw || source ? lzw : Image.blank(@width, @height, @color)
+      @lzw_cache = nil
 
       # Extended features
       if gce || delay || trans_color || disposal
@@ -135,31 +169,116 @@ module Gifenc
         @gce.trans_color = trans_color if trans_color
         @gce.disposal    = disposal    if disposal
       end
+
+      # The whole image counts as drawn, unless it's blank and transparent
+      grow_dirty(0, 0, @width, @height) if lzw || source || @color != self.trans_color
     end
 
-    # Encode the image data to GIF format and write it to a stream.
+    # Encode the image data to GIF format and write it to a stream. The whole
+    # frame (extensions, descriptor, color table and pixel data) is serialized
+    # into a single buffer first, so that it's written in one go.
     # @param stream [IO] Stream to write the data to.
-    # @todo Add support for interlaced images.
-    def encode(stream)
+    # @param lzw [String] The LZW-compressed pixel data, if it has already been
+    #   computed beforehand (see {#lzw_data}). Otherwise, the pixels will be
+    #   compressed now.
+    # @param gct [ColorTable] The global color table of the GIF. If the image
+    #   has no local color table, its bit size determines the LZW code size.
+    # @param crop [Boolean] Only encode the {#dirty} region of the image, as
+    #   if it had been cropped to it. Everything else is thus left as it was
+    #   onscreen. Compressed and untouched images are always encoded whole.
+    # @param strategy [Symbol] How the LZW dictionary is managed while
+    #   compressing the pixels:
+    #   * `:standard`: The dictionary is cleared as soon as it's full, like most
+    #     encoders do.
+    #   * `:deferred`: A full dictionary is kept for as long as the compression
+    #     ratio doesn't drop. This is usually a few percent smaller for large
+    #     frames, and is equally supported by decoders.
+    #   * `:fast`: No dictionary is built, every pixel is stored on its own
+    #     with the minimum code size. This is much faster, but only sensible
+    #     for noisy images with large palettes, which LZW barely compresses
+    #     anyway: on 8-bit noise it's even smaller, but anything with some
+    #     structure becomes several times larger. Every literal takes at least
+    #     3 bits, so for palettes of fewer than 64 colors (6 bits), where this
+    #     is always larger, `:standard` is used instead.
+    #   This has no effect on {#compress}ed images, which keep their data.
+    # @param stats [Hash] If given, it's filled with statistics about the
+    #   encoding of the image:
+    #   * `:raw_bytes`: Size of the encoded pixels before compressing them.
+    #   * `:compressed_bytes`: Size of the LZW-compressed data.
+    #   * `:cached`: Whether previously compressed data was reused. The
+    #     following LZW statistics are then those of the original compression,
+    #     except for `:lzw_time`, which is 0. For {#compress}ed images they
+    #     aren't present.
+    #   * `:codes`: Amount of LZW codes written.
+    #   * `:resets`: Amount of times the LZW dictionary was cleared.
+    #   * `:lzw_time`: Time spent compressing the pixels, in seconds.
+    #   * `:peak_buffer`: Size of the LZW encoder's output buffer, in bytes.
+    #   * `:pack_time`: Time spent packing the frame (extensions, descriptor,
+    #     color table and data) into its buffer, in seconds.
+    #   * `:write_time`: Time spent writing the frame to the stream, in seconds.
+    #   If the LZW data was computed beforehand, its statistics are expected to
+    #   be in the hash already (see {#lzw_data}).
+    def encode(stream, lzw: nil, gct: nil, crop: false, strategy: :standard, stats: nil)
+      # LZW-compressed image data (including the minimum code size)
+      crop = crop && crop_bbox
+      lzw ||= @compressed ? compressed_data : lzw_encode(crop, lzw_options(gct, crop ? crop[2] : @width, strategy: strategy), nil, stats)
+      packed = Util.clock if stats
+      buffer = String.new(capacity: header_size + lzw.bytesize, encoding: Encoding::BINARY)
+
       # Optional Graphic Control Extension before image data
-      @gce.encode(stream) if @gce
+      @gce.encode(buffer) if @gce
 
       # Image descriptor
-      stream << IMAGE_SEPARATOR
-      stream << [@x, @y, @width, @height].pack('S<4'.freeze)
+      buffer << IMAGE_SEPARATOR
+      buffer << (crop || bbox).pack('S<4'.freeze)
       flags = (@interlace ? 1 : 0) << 6
       flags |= @lct.local_flags if @lct
-      stream << [flags].pack('C'.freeze)
+      buffer << flags.chr
 
       # Local Color Table
-      @lct.encode(stream) if @lct
+      @lct.encode(buffer) if @lct
+
+      buffer << lzw
+      written = Util.clock if stats
+      result = stream << buffer
+      encode_stats(stats, crop, lzw, written - packed, Util.clock - written) if stats
+      result
+    end
 
-      # LZW-compressed image data
-      stream << "\x08".b.freeze
-      stream << (@compressed ? @pixels : Gifenc.lzw_encode(@pixels))
+    # Estimate the size of the encoded image, in bytes, in order to preallocate
+    # output buffers. It's exact for compressed images and for those whose
+    # compressed data is cached, whereas for the rest only the header is
+    # counted, since the compressed size is unknown until compressing.
+    # @return [Integer] Estimated size of the encoded image.
+    # @private
+    def encoded_size
+      lzw = @compressed ? (@source ? @source[2] : @pixels.bytesize) : @lzw_cache&.values&.last&.first&.bytesize
+      header_size + (lzw || 0)
     end
 
-    # Create a duplicate copy of this image.
+    # Compute the LZW-compressed pixel data of the image, exactly as it will
+    # appear in the GIF file, i.e., the minimum code size followed by the data
+    # sub-blocks. If the image has already been {#compress}ed, this is simply
+    # the current pixel data.
+    # @param encoder [LZWEncoder] The encoder to use. Each thread that compresses
+    #   images concurrently needs its own one. If unspecified (`nil`), the default
+    #   encoder will be used.
+    # @param gct [ColorTable] The global color table (see {#encode}).
+    # @param crop [Boolean] Only compress the {#dirty} region (see {#encode}).
+    # @param strategy [Symbol] LZW compression strategy (see {#encode}).
+    # @param stats [Hash] If given, it's filled with the LZW statistics, unless
+    #   the image is compressed already (see {#encode}).
+    # @return [String] The compressed pixel data, as a binary string.
+    def lzw_data(encoder: nil, gct: nil, crop: false, strategy: :standard, stats: nil)
+      return compressed_data if @compressed
+      crop = crop && crop_bbox
+      lzw_encode(crop, lzw_options(gct, crop ? crop[2] : @width, strategy: strategy), encoder, stats)
+    end
+
+    # Create a duplicate copy of this image. If the image is compressed, so
+    # will be the copy, sharing the same compressed data. Otherwise, both share
+    # the same pixel buffer until either of them is modified, and an untouched
+    # copy is only LZW-compressed once when encoding.
     # @return [Image] The new image.
     def dup
       lct = @lct ? @lct.dup : nil
@@ -167,8 +286,13 @@ module Gifenc
       image = Image.new(
         @width, @height, @x, @y,
         color: @color, gce: gce, delay: @delay, trans_color: @trans_color,
-        disposal: @disposal, interlace: @interlace, lct: lct
-      ).replace(@pixels.dup)
+        disposal: @disposal, interlace: @interlace, lct: lct,
+        lzw: @compressed && !@source ? @pixels : nil, source: @source
+      )
+      image.replace(@pixels) if !@compressed
+      image.clean
+      image.grow_dirty(*dirty) if @dirty
+      image.lzw_cache = (@lzw_cache ||= {}) if !@compressed
       image
     end
 
@@ -225,11 +349,12 @@ module Gifenc
 
     # Set the index (in the color table) of the transparent color. Pixels with
     # this color aren't rendered, and instead the background shows through them.
-    # See {Extension::GraphicControl#trans_color} for more details.
+    # See {Extension::GraphicControl#trans_color} for more details. Setting it
+    # to `nil` disables transparency.
     # @return (see #trans_color)
     # @see (see #trans_color)
     def trans_color=(value)
-      return if !value
+      return @gce && @gce.trans_color = nil if !value
       @gce = Extension::GraphicControl.new if !@gce
       @gce.trans_color = value
     end
@@ -242,7 +367,7 @@ module Gifenc
       if row < 0 || row >= @height
         raise Exception::CanvasError, "Row out of bounds."
       end
-      @pixels[row * @width, @width].bytes
+      pixels[row * @width, @width].bytes
     end
 
     # Fetch one column of pixels from the image.
@@ -253,23 +378,60 @@ module Gifenc
       if col < 0 || col >= @width
         raise Exception::CanvasError, "Column out of bounds."
       end
-      @height.times.map{ |r| self[col, r].ord }
+      get_col_raw(col, 0, @height).bytes # Refer to main.c
+    end
+
+    # Overwrite (a portion of) one column of pixels of the image. This is
+    # the vertical analogue of {#set_rect} for a single column.
+    # @param col [Integer] The index of the column to change.
+    # @param data [String] The new pixels, as a packed binary string with one
+    #   byte (color index) per pixel, from top to bottom.
+    # @param y [Integer] The row of the first pixel to change.
+    # @return (see #initialize)
+    # @raise [Exception::CanvasError] If the pixels would fall out of bounds.
+    def set_col(col, data, y: 0)
+      region_check(col, y, 1, data.bytesize)
+      set_col_raw(col, y, data)
+      touch(col, y, 1, data.bytesize)
     end
 
     # Change the pixel data (color indices) of the image. The size of the array
     # must match the current dimensions of the canvas, otherwise a manual resize
-    # is first required.
+    # is first required, or a new bounding box must be provided.
     # @param pixels [String] The new pixel data to fill the canvas, as a binary string.
+    #   The string isn't copied: the image shares its buffer until either of them
+    #   is modified.
+    # @param bbox [Array<Integer>] The new bounding box of the image, in the
+    #   format `[X, Y, W, H]`, if the new pixels have different dimensions.
     # @raise [Exception::CanvasError] If the supplied pixel data length doesn't match the
     #   canvas's current dimensions.
     # @return (see #initialize)
-    def replace(pixels)
-      if pixels.length != @width * @height
+    def replace(pixels, bbox: nil)
+      width, height = bbox ? bbox[2, 2] : [@width, @height]
+      if pixels.bytesize != width * height
         raise Exception::CanvasError, "Pixel data doesn't match image dimensions. Please\
           resize the image first."
       end
-      @pixels = pixels.b
-      self
+      @x, @y, @width, @height = bbox if bbox
+      @pixels = pixels.dup.force_encoding(Encoding::BINARY)
+      @source = nil
+      @compressed = false
+      touch(0, 0, @width, @height)
+    end
+
+    # Change the color indices of all pixels according to a lookup table, in
+    # place. This is needed after modifying the color table in ways that move
+    # colors to other indices (see {ColorTable#mapping}), but it can also be
+    # used to recolor the image. The transparent color is remapped too.
+    # @param mapping [String, Array<Integer>, Hash] The new index of each color
+    #   index, in any of the formats supported by {Util.lut}.
+    # @return (see #initialize)
+    # @raise [Exception::ColorTableError] If the mapping isn't valid.
+    def remap(mapping)
+      lut = Util.lut(mapping)
+      remap_raw(lut) # Refer to main.c
+      self.trans_color = lut.getbyte(trans_color) if trans_color
+      touch(0, 0, @width, @height)
     end
 
     # Destroy the pixel data of the image. This simply substitutes the contents
@@ -279,14 +441,19 @@ module Gifenc
     # @return (see #initialize)
     def destroy
       @pixels = nil
+      @lzw_cache = nil
+      @source = nil
+      @compressed = false
       self
     end
 
     # Paint the whole canvas with the base image color.
     # @return (see #initialize)
     def clear
-      @pixels = (@color.chr * (@width * @height)).b
-      self
+      @pixels = Image.blank(@width, @height, @color)
+      @source = nil
+      @compressed = false
+      touch(0, 0, @width, @height)
     end
 
     # Copy a rectangular region from another image to this one. The dimension of
@@ -356,30 +523,57 @@ module Gifenc
       bg = src.trans_color
 
       # Copy pixel data (refer to main.c)
+      touch(dx, dy, lx, ly)
       copy_raw(src, dx, dy, ox, oy, lx, ly, trans, bg)
     end
 
     # Change the image's width and height. If the provided values are smaller,
     # the image is cropped. If they are larger, the image is padded with the
     # color specified by {#color}.
+    # @param width [Integer] New width of the image.
+    # @param height [Integer] New height of the image.
     # @return (see #initialize)
+    # @raise [Exception::CanvasError] If the dimensions aren't positive.
     def resize(width, height)
-      color = @color.chr
-      if @pixels.length == 0
-        @pixels = color * (width * height)
+      if width <= 0 || height <= 0
+        raise Exception::CanvasError, "Image dimensions must be positive."
+      end
+      if !@pixels || pixels.empty?
+        @pixels = Image.blank(width, height, @color)
       else
-        @pixels = @pixels.unpack("a#{@width}" * @height).map{ |row|
-          width > @width ? row + color * (width - @width) : row.take[0 ... width]
-        }
-        @pixels = height > @height ? @pixels + [color * width] * (height - @height) : @pixels.take(height)
-        @pixels = @pixels.join.b
+        resize_raw(width, height, @color) # Refer to main.c
       end
 
       @width  = width
       @height = height
+      touch(0, 0, @width, @height)
       self
     end
 
+    # Scale the image by the given factors using nearest neighbour sampling,
+    # e.g., for making thumbnails or previews. The offset is scaled as well, so
+    # that the frames of a GIF still line up after scaling all of them (see
+    # {Gif#scale}). Integer upscaling factors take a faster path, which simply
+    # replicates each pixel into a block.
+    # @param fx [Float] Horizontal scaling factor.
+    # @param fy [Float] Vertical scaling factor. Defaults to the horizontal one.
+    # @return (see #initialize)
+    # @raise [Exception::CanvasError] If the factors aren't positive.
+    def scale(fx, fy = fx)
+      if fx <= 0 || fy <= 0
+        raise Exception::CanvasError, "Scaling factors must be positive."
+      end
+      x = (@x * fx).round
+      y = (@y * fy).round
+      width  = [((@x + @width)  * fx).round - x, 1].max
+      height = [((@y + @height) * fy).round - y, 1].max
+      @pixels = scale_raw(width, height) # Refer to main.c
+      @source = nil
+      @compressed = false
+      @x, @y, @width, @height = x, y, width, height
+      touch(0, 0, @width, @height)
+    end
+
     # Place the image at a different origin of coordinates.
     # @param x [Integer] New origin horizontal coordinate.
     # @param y [Integer] New origin vertical coordinate.
@@ -408,12 +602,81 @@ module Gifenc
       self
     end
 
-    def compress
+    # LZW-compress the pixel data now, substituting the raw pixels, in order to
+    # save memory. The image can no longer be modified afterwards.
+    # @param gct [ColorTable] The global color table that will be used for this
+    #   image, if it has no local one. It determines the LZW code size.
+    # @param strategy [Symbol] LZW compression strategy (see {#encode}).
+    # @raise [Exception::CanvasError] If the image is already compressed.
+    def compress(gct = nil, strategy: :standard)
       raise Exception::CanvasError, "Image is already compressed." if @compressed
-      @pixels = Gifenc.lzw_encode(@pixels)
+      @pixels = lzw_encode(nil, lzw_options(gct, strategy: strategy))
+      @lzw_cache = nil
       @compressed = true
     end
 
+    # Decompress the pixel data of a compressed image, so that it can be used
+    # again. This happens automatically whenever a compressed image is
+    # modified, whereas reading its pixels leaves it compressed (see {#pixels}).
+    # @return (see #initialize)
+    # @raise [Exception::CanvasError] If the image is not compressed.
+    def decompress
+      raise Exception::CanvasError, "Image is not compressed." if !@compressed
+      @pixels = decoded_pixels
+      Image.decoded = nil
+      @source = nil
+      @compressed = false
+      self
+    end
+
+    # Whether the pixel data of the image is currently LZW-compressed.
+    # @return [Boolean] Compression status.
+    # @see #compress
+    # @see #decompress
+    def compressed?
+      @compressed
+    end
+
+    # Bounding box of the region of the image that has been drawn on since it
+    # was created or last {#clean}ed. New images start fully dirty, except for
+    # blank transparent ones. All the drawing methods grow it as they modify
+    # pixels, so that the image can later be cropped to its actual
+    # changes, e.g. when encoding (see {Gif#encode}) or optimizing (see
+    # {Gif#optimize!}). The format is `[X, Y, W, H]`, relative to the image.
+    # @return [Array<Integer>] The dirty rectangle, or `nil` if untouched.
+    # @see #touch
+    # @see #clean
+    def dirty
+      return if !@dirty
+      [@dirty[0], @dirty[1], @dirty[2] - @dirty[0] + 1, @dirty[3] - @dirty[1] + 1]
+    end
+
+    # Reset the dirty rectangle, so that only the drawing done from now on is
+    # tracked. Typically done right after duplicating the previous frame.
+    # @return (see #initialize)
+    # @see #dirty
+    def clean
+      @dirty = nil
+      self
+    end
+
+    # Grow the dirty rectangle to include the given region. The drawing methods
+    # already do this, so this is only needed after modifying the {#pixels}
+    # by other means. Since the image is about to be modified, it's
+    # decompressed if needed.
+    # @param x [Integer] X coordinate of the upper left corner of the region.
+    # @param y [Integer] Y coordinate of the upper left corner of the region.
+    # @param w [Integer] Width of the region.
+    # @param h [Integer] Height of the region.
+    # @return (see #initialize)
+    # @see #dirty
+    def touch(x, y, w = 1, h = 1)
+      return self if !grow_dirty(x, y, w, h)
+      decompress if @compressed
+      @lzw_cache = nil
+      self
+    end
+
     # Returns the bounding box of the image. This is a tuple of the form
     # `[X, Y, W, H]`, where `[X, Y]` are the coordinates of its upper left
     # corner - i.e., it's offset in the logical screen - and `[W, H]` are
@@ -429,7 +692,7 @@ module Gifenc
     # @param y [Integer] The Y coordinate of the pixel.
     # @return [Char] The color index of the pixel, as a 1-char binary string.
     def [](x, y)
-      @pixels[y * @width + x]
+      pixels[y * @width + x]
     end
 
     # Set the value (color _index_) of a pixel fast (i.e. without bound checks).
@@ -439,6 +702,8 @@ module Gifenc
     # @param color [Char] The new color index of the pixel, as a 1-char binary string.
     # @return [Char] The new color index of the pixel.
     def []=(x, y, color)
+      decompress if @compressed
+      touch(x, y)
       @pixels[y * @width + x] = color
     end
 
@@ -451,9 +716,7 @@ module Gifenc
     def get(points)
       bound_check([points.min_by(&:first)[0], points.min_by(&:last)[1]], false)
       bound_check([points.max_by(&:first)[0], points.max_by(&:last)[1]], false)
-      points.map{ |p|
-        @pixels[p[1] * @width + p[0]].ord
-      }
+      get_raw(points) # Refer to main.c
     end
 
     # Set the values (color _index_) of a list of pixels safely (i.e. with bound
@@ -469,10 +732,62 @@ module Gifenc
     def set(points, colors)
       bound_check([points.min_by(&:first)[0], points.min_by(&:last)[1]], false)
       bound_check([points.max_by(&:first)[0], points.max_by(&:last)[1]], false)
-      single = colors.is_a?(Integer)
-      points.each_with_index{ |p, i|
-        @pixels[p[1] * @width + p[0]] = single ? (color & 0xFF).chr : (colors[i] & 0xFF).chr
-      }
+      x0, x1 = points.minmax_by(&:first).map(&:first)
+      y0, y1 = points.minmax_by(&:last).map(&:last)
+      touch(x0, y0, x1 - x0 + 1, y1 - y0 + 1)
+      set_raw(points, colors) # Refer to main.c
+    end
+
+    # Fetch the pixels of a rectangular region of the image in bulk. When the
+    # region spans entire rows, no copy is made until either the image or the
+    # result are modified.
+    # @param x [Integer] X coordinate of the upper left corner of the region.
+    # @param y [Integer] Y coordinate of the upper left corner of the region.
+    # @param w [Integer] Width of the region.
+    # @param h [Integer] Height of the region.
+    # @return [String] The pixels of the region, as a packed binary string with
+    #   one byte (color index) per pixel, in row-major order.
+    # @raise [Exception::CanvasError] If the region is out of bounds.
+    def get_rect(x, y, w, h)
+      region_check(x, y, w, h)
+      get_rect_raw(x, y, w, h) # Refer to main.c
+    end
+
+    # Overwrite the pixels of a rectangular region of the image in bulk. This
+    # is the inverse of {#get_rect}, and is the fastest way to feed externally
+    # rendered data into a portion of the image.
+    # @param x [Integer] X coordinate of the upper left corner of the region.
+    # @param y [Integer] Y coordinate of the upper left corner of the region.
+    # @param w [Integer] Width of the region.
+    # @param h [Integer] Height of the region.
+    # @param data [String] The new pixels, as a packed binary string with one
+    #   byte (color index) per pixel, in row-major order.
+    # @return (see #initialize)
+    # @raise [Exception::CanvasError] If the region is out of bounds, or the data
+    #   doesn't match its size.
+    def set_rect(x, y, w, h, data)
+      region_check(x, y, w, h)
+      if data.bytesize != w * h
+        raise Exception::CanvasError, "Pixel data doesn't match region dimensions."
+      end
+      set_rect_raw(x, y, w, h, data) # Refer to main.c
+      touch(x, y, w, h)
+    end
+
+    # Fill a rectangular region of the image with a single color. Unlike {#rect},
+    # this takes the region directly and doesn't support strokes, and it fails
+    # if the region isn't within the image, rather than clipping it.
+    # @param x [Integer] X coordinate of the upper left corner of the region.
+    # @param y [Integer] Y coordinate of the upper left corner of the region.
+    # @param w [Integer] Width of the region.
+    # @param h [Integer] Height of the region.
+    # @param color [Integer] Index of the color to fill the region with.
+    # @return (see #initialize)
+    # @raise [Exception::CanvasError] If the region is out of bounds.
+    def fill_rect(x, y, w, h, color)
+      region_check(x, y, w, h)
+      drawn = rect_raw(x, y, x + w - 1, y + h - 1, color) # Refer to main.c
+      touch(*drawn) if drawn
       self
     end
 
@@ -481,13 +796,21 @@ module Gifenc
     # @param x [Integer] X coordinate of the starting pixel.
     # @param y [Integer] Y coordinate of the starting pixel.
     # @param color [Integer] Index of the color to fill the region with.
+    # @param connectivity [Integer] Either `4` (default), where only horizontally
+    #   and vertically adjacent pixels are contiguous, or `8`, where diagonal
+    #   neighbours are too.
+    # @param bbox [Array<Integer>] Bounding box determining the region to which
+    #   the fill will be restricted, in the format `[X, Y, W, H]`. If unspecified
+    #   (`nil`), this defaults to the whole image.
     # @return (see #initialize)
     # @raise [Exception::CanvasError] If the specified point is out of bounds.
-    def fill(x, y, color)
-      color = color.chr if color.is_a?(Integer)
+    def fill(x, y, color, connectivity: 4, bbox: nil)
       bound_check([x, y], false)
-      return self if self[x, y] == color
-      fill_span(x, y, self[x, y], color)
+      if ![4, 8].include?(connectivity)
+        raise Exception::CanvasError, "Connectivity must be either 4 or 8."
+      end
+      drawn = fill_raw(x, y, color, connectivity, bbox) # Refer to main.c
+      touch(*drawn) if drawn
       self
     end
 
@@ -551,22 +874,12 @@ module Gifenc
       end
       pattern = parse_line_pattern(style, density, weight) unless pattern
 
-      if (p2 - p1).norm < Geometry::PRECISION
-        a = Geometry::ORIGIN
-      else
-        a = (p2 - p1).normal_right.normalize_inf
-        a -= a * (1 - anchor)
-      end
-      steps = (p2 - p1).norm_inf.ceil + 1
-      delta = (p2 - p1) / [(steps - 1), 1].max
-      point = p1
-      brush = Brush.square(weight, color, [a.x, a.y])
-      steps.times.each_with_index{ |s|
-        if (s - pattern_offset) % pattern.sum < pattern[0]
-          brush.draw(point.x.round, point.y.round, self, bbox: bbox)
-        end
-        point += delta
-      }
+      # Rasterize line with a square brush (refer to main.c)
+      drawn = line_raw(
+        p1.x, p1.y, p2.x, p2.y, color, weight, anchor,
+        pattern[0], pattern[1], pattern_offset, bbox
+      )
+      touch(*drawn) if drawn
 
       self
     end
@@ -612,13 +925,10 @@ module Gifenc
       stroke = stroke.chr if stroke && stroke.is_a?(Integer)
       fill = fill.chr if fill && fill.is_a?(Integer)
 
-      # Fill rectangle, if provided
+      # Fill rectangle, if provided (refer to main.c)
       if fill
-        (x0 .. x1).each{ |x|
-          (y0 .. y1).each{ |y|
-            @pixels[y * @width + x] = fill
-          }
-        }
+        drawn = rect_raw(x0, y0, x1, y1, fill)
+        touch(*drawn) if drawn
       end
 
       # Rectangle border
@@ -718,20 +1028,13 @@ module Gifenc
     def ellipse(c, r, stroke = nil, fill = nil, weight: 1, style: :smooth)
       # Parse data
       return self if !stroke && !fill
+      decompress if @compressed
       a = r[0]
       b = r[1]
       c = Geometry::Point.parse(c).round
-      e1 = Geometry::E1
-      e2 = Geometry::E2
-      upper = (c - e2 * b).round
-      lower = (c + e2 * b).round
-      left  = (c - e1 * a).round
-      right = (c + e1 * a).round
-      if !Geometry.bound_check([upper, lower, left, right], self, true)
+      if (c.x - a).round < 0 || (c.x + a).round >= @width || (c.y - b).round < 0 || (c.y + b).round >= @height
         raise Exception::CanvasError, "Ellipse out of bounds."
       end
-      stroke = stroke.chr if stroke && stroke.is_a?(Integer)
-      fill = fill.chr if fill && fill.is_a?(Integer)
       if stroke
         weight = [weight.to_i, 1].max
         if weight > [a, b].min
@@ -739,49 +1042,11 @@ module Gifenc
           stroke = nil
         end
       end
-      f = (a.to_f / b) ** 2
-
-      # Fill
-      if fill
-        b.round.downto(0).each{ |y|
-          midpoint1 = ((c.y - y) * @width + c.x).round
-          midpoint2 = ((c.y + y) * @width + c.x).round if y > 0
-          partial_r = (y > 0 ? (a ** 2 - f * (y - 0.5) ** 2) ** 0.5 : a).round
-          @pixels[midpoint1 - partial_r, 2 * partial_r + 1] = fill * (2 * partial_r + 1)
-          @pixels[midpoint2 - partial_r, 2 * partial_r + 1] = fill * (2 * partial_r + 1) if y > 0
-        }
-      end
-
-      # Stroke
-      if stroke
-        prev_r = 0
-        b.round.downto(0).each{ |y|
-          midpoint1 = ((c.y - y) * @width + c.x).round
-          midpoint2 = ((c.y + y) * @width + c.x).round if y > 0
-          partial_r = (y > 0 ? (a ** 2 - f * (y - 0.5) ** 2) ** 0.5 : a).round
-          if style == :grid
-            border = [weight + partial_r - prev_r, 1 + partial_r].min
-            (0 ... [weight, y + 1].min).each{ |w|
-              @pixels[midpoint1 - partial_r                + w * @width, border] = stroke * border
-              @pixels[midpoint1 + partial_r - (border - 1) + w * @width, border] = stroke * border
-              @pixels[midpoint2 - partial_r                - w * @width, border] = stroke * border if y > 0
-              @pixels[midpoint2 + partial_r - (border - 1) - w * @width, border] = stroke * border if y > 0
-            }
-            prev_r = partial_r
-          elsif style == :smooth
-            a2 = [a - weight, 0].max
-            b2 = [b - weight, 0].max
-            f2 = (a2.to_f / b2) ** 2
-            partial_r2 = (y > 0 ? (a2 ** 2 >= f2 * (y - 0.5) ** 2 ? (a2 ** 2 - f2 * (y - 0.5) ** 2) ** 0.5 : -1) : a2).round
-            border = partial_r - partial_r2
-            @pixels[midpoint1 - partial_r               , border] = stroke * border
-            @pixels[midpoint1 + partial_r - (border - 1), border] = stroke * border
-            @pixels[midpoint2 - partial_r               , border] = stroke * border if y > 0
-            @pixels[midpoint2 + partial_r - (border - 1), border] = stroke * border if y > 0
-          end
-        }
-      end
+      stroke = nil if ![:smooth, :grid].include?(style)
 
+      # Rasterize the spans of each row (refer to main.c)
+      drawn = ellipse_raw(c.x, c.y, a, b, stroke, fill, weight, style == :grid)
+      touch(*drawn) if drawn
       self
     end
 
@@ -807,9 +1072,41 @@ module Gifenc
       ellipse(c, [r, r], stroke, fill, weight: weight, style: style)
     end
 
+    # Draw a path through a sequence of points, joining each of them to the
+    # next one with a straight line (see {#line}). The whole path is rasterized
+    # natively in one go, so it's the way to go for long polylines, like the
+    # ones resulting from sampling curves or functions. The points can be
+    # supplied packed as native doubles, avoiding creating an object for each
+    # one (see {Geometry.pack_points}).
+    # @param points [Array,String] The points, in any format accepted by
+    #   {Geometry.pack_points}. Gaps (`nil` or NaN points) interrupt the path.
+    # @param color [Integer] Index of the color of the path.
+    # @param weight [Integer] Width of the path in pixels.
+    # @param anchor [Float] Position of the lines with respect to the points
+    #   (see {#line}).
+    # @param bbox [Array<Integer>] Bounding box to restrict the drawing to, in
+    #   the format `[X, Y, W, H]` (see {#line}).
+    # @param style [Symbol] Named style of the lines (see {#line}).
+    # @param density [Symbol] Density of the line style (see {#line}).
+    # @param pattern [Array<Integer>] ON / OFF pattern of the lines (see {#line}).
+    # @param pattern_offset [Integer] Shift of the pattern (see {#line}). Like
+    #   with separate lines, the pattern starts over at each point.
+    # @return (see #initialize)
+    def path(points, color: 0, weight: 1, anchor: 0, bbox: nil, style: :solid,
+      density: :normal, pattern: nil, pattern_offset: 0)
+      pattern = parse_line_pattern(style, density, weight) unless pattern
+      drawn = path_raw(
+        Geometry.pack_points(points), color, weight, anchor,
+        pattern[0], pattern[1], pattern_offset, bbox
+      ) # Refer to main.c
+      touch(*drawn) if drawn
+      self
+    end
+
     # Draw a polygonal chain connecting a sequence of points. This simply consists
-    # in joining them in order with straight lines.
-    # @param points [Array<Point>] The list of points, in order, to join.
+    # in joining them in order with straight lines (see {#path}).
+    # @param points [Array<Point>,String] The list of points, in order, to join.
+    #   They may also be packed (see {Geometry.pack_points}).
     # @param line_color [Integer] The index of the color to use for the lines.
     # @param line_weight [Float] The size of the line stroke, in pixels.
     # @param node_color [Integer] The index of the color to use for the nodes.
@@ -824,14 +1121,18 @@ module Gifenc
         node_weight: 0
       )
       node_color = line_color unless node_color
-      0.upto(points.size - 2).each{ |i|
-        next if !points[i] || !points[i + 1]
-        line(p1: points[i], p2: points[i + 1], color: line_color, weight: line_weight) rescue nil
-      }
-      points.each{ |p|
-        next if !p
-        circle(p, node_weight, nil, node_color)
-      }
+      points = Geometry.pack_points(points)
+      path(points, color: line_color, weight: line_weight)
+
+      # Nodes, checking the bounds of all of them at once, like #circle would
+      x0, y0, x1, y1 = Gifenc.points_bounds(points) # Refer to main.c
+      return self if !x0
+      if (x0.round - node_weight).round < 0 || (x1.round + node_weight).round >= @width ||
+         (y0.round - node_weight).round < 0 || (y1.round + node_weight).round >= @height
+        raise Exception::CanvasError, "Polygonal chain nodes out of bounds."
+      end
+      drawn = dots_raw(points, node_color, node_weight) # Refer to main.c
+      touch(*drawn) if drawn
       self
     end
 
@@ -869,7 +1170,7 @@ module Gifenc
           please specify either the step or the dots argument."
       end
       step = (to - from).abs.to_f / (dots + 1) if !step
-      points = (from .. to).step(step).map{ |t| func.call(t) }
+      points = (from .. to).step(step).flat_map{ |t| func.call(t) || [Float::NAN, Float::NAN] }.pack('d*')
       node_color = line_color unless node_color
       polygonal(points, line_color: line_color, line_weight: line_weight,
         node_color: node_color, node_weight: node_weight)
@@ -906,11 +1207,12 @@ module Gifenc
         control_points: 64
       )
       center = Geometry::Point.parse(center)
+      cx, cy = center.x, center.y
       curve(
         -> (t) {
           [
-            center.x + scale_x.call(t) * Math.cos(angle + speed * t),
-            center.y + scale_y.call(t) * Math.sin(angle + speed * t)
+            cx + scale_x.call(t) * Math.cos(angle + speed * t),
+            cy + scale_y.call(t) * Math.sin(angle + speed * t)
           ]
         },
         from, to, step: 2 * Math::PI / control_points,
@@ -1098,11 +1400,11 @@ module Gifenc
       end
 
       # Graph
+      ox, oy = origin.x, origin.y
       curve(
         -> (t) {
-          x = origin.x + x_scale * t
-          y = origin.y - y_scale * func.call(t)
-          func.call(t).between?(y_from, y_to) ? [x, y] : nil
+          y = func.call(t)
+          y.between?(y_from, y_to) ? [ox + x_scale * t, oy - y_scale * y] : nil
         },
         x_from, x_to, dots: 100, line_color: color, line_weight: weight
       )
@@ -1200,13 +1502,8 @@ module Gifenc
       #   in the format `[X, Y, W, H]`.
       def draw(x, y, img, color = @color, bbox: nil)
         raise Exception::CanvasError, "No provided color nor default color found." if !color
-        bbox = [0, 0, img.width, img.height] if !bbox
-        color = color.chr if color.is_a?(Integer)
-        @pixels.each{ |dx, dy|
-          if Geometry.bound_check([[x + dx, y + dy]], bbox, true)
-            img[x + dx, y + dy] = color
-          end
-        }
+        drawn = img.brush_raw(x, y, @pixels, color, bbox) # Refer to main.c
+        img.touch(*drawn) if drawn
       end
     end
 
@@ -1219,36 +1516,184 @@ module Gifenc
       Geometry.bound_check([point], self, silent)
     end
 
+    # Ensure a rectangular region [X, Y, W, H] lies within the image.
+    def region_check(x, y, w, h)
+      if x < 0 || y < 0 || w < 0 || h < 0 || x + w > @width || y + h > @height
+        raise Exception::CanvasError, "Region out of bounds."
+      end
+    end
+
+    # Bit size of the color table that applies to this image, which determines
+    # the minimum LZW code size. Without any table, the full 8 bits are used.
+    # @param gct [ColorTable] The global color table (see {#encode}).
+    # @return [Integer] The bit size.
+    def lzw_bits(gct = nil)
+      table = @lct || gct
+      table ? table.bit_size : 8
+    end
+
+    # Options to LZW-compress the pixels with (refer to lzw.c): the
+    # minimum code size, the strategy and, if the image is interlaced, the width
+    # of its rows, so that they're compressed in interlaced order.
+    # @param gct [ColorTable] The global color table (see {#encode}).
+    # @param width [Integer] Width of the pixels to compress, if cropped.
+    # @param strategy [Symbol] LZW compression strategy (see {#encode}).
+    # @return [Hash] The options.
+    # @api private
+    def lzw_options(gct = nil, width = @width, strategy: :standard)
+      { bits: lzw_bits(gct), interlace: @interlace && width, strategy: strategy }
+    end
+
+    # Everything that determines how the image is displayed, except for its
+    # delay, used to find repeated frames (see {Gif#encode}). Compressed images
+    # are compared by their compressed data.
+    # @param crop [Boolean] Whether the image will be cropped when encoding.
+    # @return [Array] The signature of the image.
+    # @api private
+    def signature(crop: false)
+      data = @compressed ? compressed_data : @pixels
+      gce = @gce && [@gce.disposal, @gce.user_input, @gce.trans_color]
+      [data, bbox, crop && crop_bbox, @interlace, @lct && @lct.colors.take(@lct.size), gce]
+    end
+
+    # Adopt LZW data that was compressed in the background from an earlier
+    # snapshot of the pixels, unless the image has been modified since.
+    # @param snapshot [String] The pixels that were compressed.
+    # @param lzw [String] The compressed data (see {#lzw_data}).
+    # @return [Boolean] Whether the image is now compressed.
+    # @api private
+    def adopt_lzw(snapshot, lzw)
+      return true if @compressed
+      return false if @pixels != snapshot
+      @pixels = lzw
+      @compressed = true
+    end
+
+    # Get a blank pixel buffer of the given size and color, as used by new and
+    # {#clear}ed images. It shares the memory of a pooled template, so that
+    # it's only allocated when first modified.
+    # @param width [Integer] Width of the buffer in pixels.
+    # @param height [Integer] Height of the buffer in pixels.
+    # @param color [Integer] Index of the color to fill the buffer with.
+    # @return [String] The blank pixels, as a binary string.
+    # @api private
+    def self.blank(width, height, color)
+      key = [width, height, color]
+      template = @blank_pool.delete(key) || (color.chr * (width * height)).b.freeze
+      @blank_pool.shift if @blank_pool.size >= BLANK_POOL_SIZE
+      @blank_pool[key] = template
+      template.dup
+    end
+
+    protected
+
+    # Cache of the LZW compressions of the pixels, shared with duplicates until
+    # either of them is modified (see {#lzw_encode}).
+    attr_writer :lzw_cache
+
+    # Grow the dirty rectangle to include the given region (see {#touch}),
+    # without modifying the image otherwise.
+    # @return [Boolean] Whether the region wasn't empty.
+    def grow_dirty(x, y, w, h)
+      x0 = x < 0 ? 0 : x
+      y0 = y < 0 ? 0 : y
+      x1 = x + w > @width ? @width - 1 : x + w - 1
+      y1 = y + h > @height ? @height - 1 : y + h - 1
+      return false if x0 > x1 || y0 > y1
+      if !@dirty
+        @dirty = [x0, y0, x1, y1]
+      else
+        @dirty[0] = x0 if x0 < @dirty[0]
+        @dirty[1] = y0 if y0 < @dirty[1]
+        @dirty[2] = x1 if x1 > @dirty[2]
+        @dirty[3] = y1 if y1 > @dirty[3]
+      end
+      true
+    end
+
     private
 
-    # Given a pixel:
-    # * Find the row span which shares that pixel's color.
-    # * Fill it with a new (different) color.
-    # * Repeat recursively for the previous and next row.
-    # Used for flood fill algorithm.
-    def fill_span(x, y, old_color, new_color)
-      # Nothing to fill from this seed
-      return if self[x, y] != old_color
-      self[x, y] = new_color
-
-      # Find negative span and fill it
-      x_min = x - 1
-      while x_min >= 0 && self[x_min, y] == old_color
-        self[x_min, y] = new_color
-        x_min -= 1
+    # The bounding box, in the logical screen, of the dirty region of the image,
+    # or `nil` if it's untouched or compressed (see {#encode}).
+    def crop_bbox
+      return if !@dirty || @compressed
+      x, y, w, h = dirty
+      [@x + x, @y + y, w, h]
+    end
+
+    # The pixels of the dirty region of the image (see {#crop_bbox}).
+    def crop_pixels
+      x, y, w, h = dirty
+      return @pixels if w == @width && h == @height
+      get_rect_raw(x, y, w, h) # Refer to main.c
+    end
+
+    # LZW-compress the pixels, or only those of the dirty region if a crop is
+    # given, reusing an earlier result of this image or any of its duplicates.
+    # The cache is shared with duplicates, and {#touch} detaches an image from
+    # it, so every image that still holds it has the same pixels, and untouched
+    # duplicates are only compressed once. Entries are keyed by the dirty region
+    # and the options, and keep the LZW statistics to report them on a hit.
+    def lzw_encode(crop, options, encoder = nil, stats = nil)
+      cache = (@lzw_cache ||= {})
+      key = [crop && dirty, options]
+      lzw, lzw_stats = cache[key]
+      if lzw
+        stats&.merge!(lzw_stats, lzw_time: 0.0, cached: true)
+        return lzw
       end
+      pixels = crop ? crop_pixels : @pixels
+      lzw_stats = {}
+      lzw = encoder ? encoder.encode(pixels, **options, stats: lzw_stats) : Gifenc.lzw_encode(pixels, **options, stats: lzw_stats)
+      cache[key] = [lzw, lzw_stats]
+      stats&.merge!(lzw_stats, cached: false)
+      lzw
+    end
+
+    # Fill in the statistics of the encoding of the image (see {#encode}).
+    def encode_stats(stats, crop, lzw, pack_time, write_time)
+      stats[:raw_bytes] = crop ? crop[2] * crop[3] : @width * @height
+      stats[:compressed_bytes] = lzw.bytesize
+      stats[:cached] = true if !stats.key?(:cached)
+      stats[:pack_time] = pack_time
+      stats[:write_time] = write_time
+    end
+
+    # Size of everything that precedes the pixel data when encoding the image,
+    # i.e., the Graphic Control Extension, image descriptor and color table.
+    def header_size
+      (@gce ? 8 : 0) + 10 + (@lct ? 3 * @lct.size : 0)
+    end
 
-      # Find positive span and fill it
-      x_max = x + 1
-      while x_max < @width && self[x_max, y] == old_color
-        self[x_max, y] = new_color
-        x_max += 1
+    # The pixels of the image, for modifying them in place, decompressing it
+    # first if needed (refer to main.c).
+    def writable_pixels
+      decompress if @compressed
+      @pixels
+    end
+
+    # Decode the pixels of a compressed image, without decompressing it. The
+    # result is shared with the last one of any image, if it's still the same.
+    def decoded_pixels
+      data = @source || @pixels
+      last, pixels = Image.decoded
+      return pixels if last.equal?(data)
+      if @source
+        reader, offset, length = @source
+        pixels = reader.decode(offset, length, @width, @height, @interlace)
+      else
+        pixels = Gifenc.lzw_decode(@pixels, @width, @height, @interlace)
       end
+      Image.decoded = [data, pixels]
+      pixels
+    end
 
-      # Recursively test previous and next rows
-      span = (x_min + 1 .. x_max - 1)
-      span.each{ |x| fill_span(x, y - 1, old_color, new_color) } if y > 0
-      span.each{ |x| fill_span(x, y + 1, old_color, new_color) } if y < @height - 1
+    # The LZW-compressed data of a compressed image, reading it from the file
+    # first if it's still there.
+    def compressed_data
+      return @pixels if !@source
+      reader, offset, length = @source
+      reader.read(offset, length)
     end
 
     # Parse the line ON/OFF pattern given a few named values.
@@ -10,37 +10,68 @@ module Gifenc
     # @param data [String] Data to lay into sub-blocks.
     # @return [String] The resulting data in block fashion.
     def self.blockify(data)
-      return BLOCK_TERMINATOR if data.size == 0
-      ff = "\xFF".b.freeze
-      off = 0
-      out = "".b
-      len = data.length
-      for _ in (0 ... len / 255)
-        out << ff << data[off ... off + 255]
-        off += 255
+      return BLOCK_TERMINATOR if !data
+      Gifenc.blockify(data) # Refer to main.c
+    end
+
+    # Write a data block to a stream laid out in sub-blocks (see {.blockify}),
+    # without building the whole blockified string in memory first. The
+    # sub-blocks are written in large batches, so this is preferred for big
+    # blocks, like those of long extensions.
+    # @param stream [IO] Stream to write the data to.
+    # @param data [String] Data to lay into sub-blocks.
+    # @return [Integer] Amount of bytes written.
+    def self.write_blocks(stream, data)
+      Gifenc.write_blocks(stream, data || ''.b) # Refer to main.c
+    end
+
+    # Current time of a monotonic clock, used to time the encoding when
+    # collecting statistics (see {Gif#encode}).
+    # @return [Float] The time, in seconds.
+    def self.clock
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    # Build a 256-entry lookup table of color indices, as used by {Image#remap}.
+    # @param mapping [String, Array<Integer>, Hash] The new index of each index.
+    #   It can be a 256-byte binary string, a list of indices (where a `nil` or
+    #   a missing entry leaves that index unchanged), or a hash from old
+    #   indices to new ones.
+    # @return [String] The lookup table, as a 256-byte binary string.
+    # @raise [Exception::ColorTableError] If the mapping isn't valid.
+    def self.lut(mapping)
+      case mapping
+      when String
+        if mapping.bytesize != 256
+          raise Exception::ColorTableError, "Color index lookup tables must have 256 entries."
+        end
+        mapping.b
+      when Array, Hash
+        lut = (0 ... 256).to_a
+        if mapping.is_a?(Hash)
+          if mapping.each_key.any?{ |i| !i.is_a?(Integer) || !i.between?(0, 255) }
+            raise Exception::ColorTableError, "Color indices must be between 0 and 255."
+          end
+          mapping.each_pair{ |i, j| lut[i] = j if j }
+        end
+        mapping.each_with_index{ |j, i| lut[i] = j if j } if mapping.is_a?(Array)
+        if lut.size != 256 || lut.any?{ |j| !j.is_a?(Integer) || !j.between?(0, 255) }
+          raise Exception::ColorTableError, "Color indices must be between 0 and 255."
+        end
+        lut.pack('C*')
+      else
+        raise Exception::ColorTableError, "Invalid color index mapping."
       end
-      out << (len - off).chr << data[off..-1] if off < len
-      out << BLOCK_TERMINATOR
-      out
-    rescue
-      BLOCK_TERMINATOR
     end
 
     # Recover original data from inside the 256-byte blocks used by GIF.
     # @param data [String] Data in blocks to read.
-    # @return [String] Original raw data.
-    def self.deblockify(data)
-      out = ""
-      size = data[0].ord
-      off = 0
-      while size != 0
-        out << data[off + 1 .. off + size]
-        off += size + 1
-        size = data[off].ord
-      end
-      out
-    rescue
-      ''.b
+    # @param offset [Integer] Position of the first sub-block in the data.
+    # @return [String] Original raw data, or an empty string if the blocks are
+    #   truncated.
+    def self.deblockify(data, offset = 0)
+      return ''.b if !data
+      Gifenc.deblockify(data, offset) # Refer to main.c
     end
   end
-end
\ No newline at end of file
+end